@@ -0,0 +1,193 @@
+#include "bench.h"
+#include "dbg.h"
+#include "emu.h"
+#include "utils.h"
+#include "video.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark of the terminal output: runs typical screen updates through the
+// video emulation, writing the output to a null device, and checks that the
+// bytes written don't exceed the expected values. The last test draws in the
+// render thread to a slow terminal, and checks that the terminal is never
+// written with the lock of the terminal state held, as the emulator would
+// wait for it. The time the emulator was not running is only shown.
+
+// Time the slow terminal waits after each read, in microseconds
+#define SLOW_TERM_US 10000
+
+static struct video_stats stats;
+
+static void int10(unsigned ax, unsigned bx, unsigned cx, unsigned dx)
+{
+    cpuSetAX(ax);
+    cpuSetBX(bx);
+    cpuSetCX(cx);
+    cpuSetDX(dx);
+    intr10();
+}
+
+// Writes a string to the video memory at the given position
+static void put_str(unsigned x, unsigned y, uint8_t color, const char *s)
+{
+    for(; *s && x < 80; x++, s++)
+        put16(0xB8000 + (x + y * 80) * 2, (uint8_t)*s | (color << 8));
+}
+
+// Full screen refresh of a TUI program: a list with changing values and a
+// moving selection bar.
+static void bench_tui(unsigned frame)
+{
+    char line[81];
+    snprintf(line, sizeof(line), " File  Edit  View  Options  Help %36s%9u ", "", frame);
+    put_str(0, 0, 0x70, line);
+    for(unsigned y = 1; y < 24; y++)
+    {
+        unsigned n = (frame * 7 + y * 13) % 1000;
+        snprintf(line, sizeof(line), " %-30s %8u %8u %5u.%02u %-20s ", "PROCESS.EXE", n * 37,
+                 (n * 101 + frame) % 100000, n / 10, (n + frame) % 100,
+                 (n & 1) ? "running" : "sleeping");
+        put_str(0, y, y == 1 + frame % 23 ? 0x1F : 0x07, line);
+    }
+    snprintf(line, sizeof(line), " F1 Help  F2 Setup  F3 Search  F10 Quit %39u ", frame * 3);
+    put_str(0, 24, 0x30, line);
+}
+
+// Log output with the BIOS teletype function, scrolling the whole screen.
+static void bench_log(unsigned frame)
+{
+    char line[81];
+    snprintf(line, sizeof(line), "[%06u] compiling module %u of %u: UNIT%03u.PAS\r\n",
+             frame, frame % 97, 97u, frame % 97);
+    for(const char *s = line; *s; s++)
+        int10(0x0E00 | (uint8_t)*s, 0x0007, 0, 0);
+}
+
+// Scroll of a window inside the screen, with a new line at the bottom.
+static void bench_window(unsigned frame)
+{
+    char line[81];
+    int10(0x0601, 0x1F00, 0x0201, 0x154E);
+    snprintf(line, sizeof(line), "Message %u: window line with some text", frame);
+    put_str(2, 21, 0x1F, line);
+}
+
+// Cursor moves only, as in a program waiting for input in a form.
+static void bench_cursor(unsigned frame)
+{
+    int10(0x0200, 0, 0, ((3 + frame % 17) << 8) | (10 + frame * 7 % 60));
+}
+
+// Log output of many lines between updates, more than 64 KB in a frame if the
+// render thread is behind.
+static void bench_log_burst(unsigned frame)
+{
+    for(unsigned i = 0; i < 100; i++)
+        bench_log(frame * 100 + i);
+}
+
+// Returns the CPU time used by the calling thread in microseconds
+static uint64_t thread_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Reads the output of the render thread from a pipe, waiting after each read
+static void *slow_term(void *arg)
+{
+    int fd = *(int *)arg;
+    static char buf[65536];
+    while(read(fd, buf, sizeof(buf)) > 0)
+        usleep(SLOW_TERM_US);
+    return 0;
+}
+
+static const struct
+{
+    const char *name;
+    void (*step)(unsigned frame);
+    unsigned frames;
+    // Maximum bytes per frame allowed
+    unsigned max_bytes;
+    // Draw in the render thread
+    int render;
+} tests[] = {
+    {"full-screen TUI", bench_tui, 2000, 1000, 0},
+    {"scrolling log", bench_log, 20000, 50, 0},
+    {"window scroll", bench_window, 20000, 130, 0},
+    {"cursor moves", bench_cursor, 20000, 8, 0},
+    {"render thread", bench_log_burst, 400, 5000, 1},
+};
+
+NORETURN void bench_video(unsigned threshold)
+{
+    int fd = open("/dev/null", O_WRONLY);
+    if(fd < 0)
+        print_error("can't open '/dev/null': %s\n", strerror(errno));
+    init_cpu();
+    cpuSetSS(0x9000);
+    cpuSetSP(0xFFF0);
+    video_init_mem();
+    video_bench_init(fd, &stats);
+
+    int fail = 0;
+    printf("%-16s %8s %10s %10s %10s %10s %8s %8s\n", "test", "frames", "bytes/f", "limit",
+           "esc/f", "frames/s", "wait %", "locked");
+    for(unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        // Start each test from a clear screen
+        int10(0x0003, 0, 0, 0);
+        check_screen();
+        memset(&stats, 0, sizeof(stats));
+
+        int pipe_fd[2];
+        pthread_t term_id;
+        if(tests[i].render)
+        {
+            if(pipe(pipe_fd) || pthread_create(&term_id, 0, slow_term, &pipe_fd[0]))
+                print_error("can't start the slow terminal: %s\n", strerror(errno));
+            video_bench_render(pipe_fd[1]);
+        }
+
+        uint64_t start = emu_get_ticks(1000000), cpu = thread_time();
+        for(unsigned f = 0; f < tests[i].frames; f++)
+        {
+            tests[i].step(f);
+            check_screen();
+        }
+        uint64_t us = emu_get_ticks(1000000) - start;
+        // Time not running, waiting for the output or other threads
+        cpu = thread_time() - cpu;
+        uint64_t wait_us = us > cpu ? us - cpu : 0;
+
+        if(tests[i].render)
+        {
+            video_bench_render(-1);
+            close(pipe_fd[1]);
+            pthread_join(term_id, 0);
+            close(pipe_fd[0]);
+        }
+
+        double bytes = (double)stats.bytes / tests[i].frames;
+        double limit = tests[i].max_bytes * (1 + threshold / 100.0);
+        double wait = us ? wait_us * 100.0 / us : 0;
+        // Without the render thread, all the writes are done with the lock
+        int locked = tests[i].render && stats.locked_writes;
+        printf("%-16s %8u %10.1f %10.1f %10.2f %10.0f %8.1f %8s%s\n", tests[i].name,
+               tests[i].frames, bytes, limit, (double)stats.escapes / tests[i].frames,
+               us ? tests[i].frames * 1e6 / us : 0, wait,
+               tests[i].render ? (locked ? "yes" : "no") : "-",
+               bytes > limit || locked ? "  FAIL" : "");
+        if(bytes > limit || locked)
+            fail = 1;
+    }
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "os.h"
+
+// Runs the terminal output benchmark and exits, failing if the output of any
+// test is more than "threshold" percent over the expected size.
+NORETURN void bench_video(unsigned threshold);
@@ -0,0 +1,241 @@
+#include "cast.h"
+#include "dbg.h"
+#include "env.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The events are written to a ring buffer, and a thread writes the buffer to
+// the file, so the terminal output never waits for the file. Events that
+// don't fit in the buffer are dropped.
+#define CAST_RING_SIZE (1 << 20)
+
+static int cast_fd = -1;
+static pid_t cast_pid;
+static uint64_t cast_start;
+static unsigned cast_width, cast_height;
+static unsigned cast_dropped;
+// Bytes of an incomplete UTF-8 character at the end of the last output
+static char partial[4];
+static unsigned partial_len;
+
+// Ring buffer, "ring_head" is only written by the terminal output and
+// "ring_tail" by the writer thread.
+static char *ring;
+static unsigned ring_head, ring_tail;
+static pthread_t writer_id;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static int writer_quit;
+
+// Event being formatted
+static char *ev_buf;
+static unsigned ev_len, ev_size;
+
+// Writes the data in the ring buffer to the file
+static void *writer_thread(void *arg)
+{
+    pthread_mutex_lock(&ring_lock);
+    while(1)
+    {
+        unsigned head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        if(head == ring_tail)
+        {
+            if(writer_quit)
+                break;
+            pthread_cond_wait(&ring_cond, &ring_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ring_lock);
+        unsigned pos = ring_tail % CAST_RING_SIZE;
+        unsigned len = head - ring_tail;
+        if(len > CAST_RING_SIZE - pos)
+            len = CAST_RING_SIZE - pos;
+        ssize_t n = write(cast_fd, ring + pos, len);
+        // On errors, discard the data
+        if(n < 0 && errno == EINTR)
+            n = 0;
+        else if(n <= 0)
+            n = len;
+        pthread_mutex_lock(&ring_lock);
+        __atomic_store_n(&ring_tail, ring_tail + n, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+}
+
+// Makes room for "len" more bytes in the event
+static void ev_reserve(unsigned len)
+{
+    if(ev_len + len <= ev_size)
+        return;
+    ev_size = (ev_len + len) * 2;
+    ev_buf = realloc(ev_buf, ev_size);
+    if(!ev_buf)
+        print_error("out of memory recording the terminal.\n");
+}
+
+static void ev_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(0, 0, fmt, ap);
+    va_end(ap);
+    ev_reserve(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(ev_buf + ev_len, len + 1, fmt, ap);
+    va_end(ap);
+    ev_len += len;
+}
+
+// Sends the formatted event to the writer thread, or drops it if the ring
+// buffer is full.
+static void ev_send(void)
+{
+    unsigned head = ring_head;
+    unsigned room = CAST_RING_SIZE - (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE));
+    if(ev_len > room)
+        cast_dropped++;
+    else
+    {
+        unsigned pos = head % CAST_RING_SIZE;
+        unsigned n = ev_len < CAST_RING_SIZE - pos ? ev_len : CAST_RING_SIZE - pos;
+        memcpy(ring + pos, ev_buf, n);
+        memcpy(ring, ev_buf + n, ev_len - n);
+        __atomic_store_n(&ring_head, head + ev_len, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&ring_lock);
+        pthread_cond_signal(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+    }
+    ev_len = 0;
+}
+
+void cast_open(unsigned width, unsigned height)
+{
+    const char *name = getenv(ENV_CAST);
+    if(!name || cast_fd >= 0)
+        return;
+    cast_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(cast_fd < 0)
+        print_error("can't create cast file '%s': %s\n", name, strerror(errno));
+    ring = malloc(CAST_RING_SIZE);
+    if(!ring)
+        print_error("out of memory recording the terminal.\n");
+    // Signals are handled only by the emulator thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if(pthread_create(&writer_id, 0, writer_thread, 0))
+        print_error("can't start the cast writer thread.\n");
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    cast_pid = getpid();
+    cast_start = emu_get_ticks(1000000);
+    cast_width = width;
+    cast_height = height;
+    ev_printf("{\"version\": 2, \"width\": %u, \"height\": %u, \"timestamp\": %lld}\n",
+              width, height, (long long)time(0));
+    ev_send();
+}
+
+// Writes the start of an event, with the time since the start of recording
+static void write_time(void)
+{
+    uint64_t t = emu_get_ticks(1000000) - cast_start;
+    ev_printf("[%" PRIu64 ".%06u, ", t / 1000000, (unsigned)(t % 1000000));
+}
+
+// Returns byte "i" of the partial character followed by the new output
+static uint8_t get_byte(const char *buf, unsigned i)
+{
+    return i < partial_len ? partial[i] : buf[i - partial_len];
+}
+
+void cast_output(const char *buf, unsigned len)
+{
+    if(cast_fd < 0 || !len)
+        return;
+
+    // Output follows the partial character from the last call
+    unsigned total = partial_len + len;
+
+    // JSON strings must be valid UTF-8, so keep an incomplete character at the
+    // end for the next call
+    unsigned keep = 0;
+    for(unsigned i = 1; i <= 4 && i <= total; i++)
+    {
+        uint8_t c = get_byte(buf, total - i);
+        if((c & 0xC0) == 0x80)
+            continue;
+        unsigned need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        if(need > i)
+            keep = i;
+        break;
+    }
+
+    if(keep < total)
+    {
+        write_time();
+        ev_printf("\"o\", \"");
+        // Each byte takes up to 6 characters
+        ev_reserve((total - keep) * 6 + 4);
+        char *p = ev_buf + ev_len;
+        for(unsigned i = 0; i < total - keep; i++)
+        {
+            uint8_t c = get_byte(buf, i);
+            if(c == '"' || c == '\\')
+            {
+                *p++ = '\\';
+                *p++ = c;
+            }
+            else if(c < 0x20 || c == 0x7F)
+                p += sprintf(p, "\\u%04x", c);
+            else
+                *p++ = c;
+        }
+        memcpy(p, "\"]\n", 3);
+        ev_len = p + 3 - ev_buf;
+        ev_send();
+    }
+    char tail[4];
+    for(unsigned i = 0; i < keep; i++)
+        tail[i] = get_byte(buf, total - keep + i);
+    memcpy(partial, tail, keep);
+    partial_len = keep;
+}
+
+void cast_resize(unsigned width, unsigned height)
+{
+    if(cast_fd < 0 || (width == cast_width && height == cast_height))
+        return;
+    cast_width = width;
+    cast_height = height;
+    write_time();
+    ev_printf("\"r\", \"%ux%u\"]\n", width, height);
+    ev_send();
+}
+
+void cast_close(void)
+{
+    // A forked child process has no writer thread
+    if(cast_fd < 0 || getpid() != cast_pid)
+        return;
+    pthread_mutex_lock(&ring_lock);
+    writer_quit = 1;
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+    pthread_join(writer_id, 0);
+    close(cast_fd);
+    cast_fd = -1;
+    if(cast_dropped)
+        fprintf(stderr, "%s: terminal recording: %u events dropped, the file was too slow.\n",
+                prog_name, cast_dropped);
+}
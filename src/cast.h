@@ -0,0 +1,18 @@
+#pragma once
+
+// Recording of the terminal output to a file in asciicast v2 format.
+// The functions must be called with the terminal output serialized, they
+// don't write to the file directly, so they never wait for it.
+
+// Starts recording to the file given in the environment, if any, with the
+// size of the emulated screen.
+void cast_open(unsigned width, unsigned height);
+
+// Records the bytes sent to the terminal.
+void cast_output(const char *buf, unsigned len);
+
+// Records a change of the emulated screen size.
+void cast_resize(unsigned width, unsigned height);
+
+// Ends the recording.
+void cast_close(void);
@@ -1,6 +1,7 @@
 #include "codepage.h"
 #include "dbg.h"
 #include "env.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -205,6 +206,60 @@ static const struct cp_data cp_data[] = {
 
 static const uint16_t *cp_table = cp_data[0].table;
 
+/* Tables built from the current codepage: the UTF-8 encoding of each DOS char,
+ * and the reverse lookup from Unicode, as pages of 256 DOS chars indexed by the
+ * high byte. Page 0 is shared by all the code-points not in the codepage. */
+static struct cp_utf8 utf8_table[256];
+static uint8_t rev_pages[257][256];
+static uint8_t *rev_index[256];
+
+static void update_tables(void)
+{
+    unsigned pages = 1;
+    memset(rev_pages[0], ' ', 256);
+    for(int i = 0; i < 256; i++)
+        rev_index[i] = rev_pages[0];
+    // Go backwards, so repeated code-points give the lowest DOS char
+    for(int i = 255; i >= 0; i--)
+    {
+        uint16_t uc = cp_table[i];
+        if(rev_index[uc >> 8] == rev_pages[0])
+        {
+            memset(rev_pages[pages], ' ', 256);
+            rev_index[uc >> 8] = rev_pages[pages++];
+        }
+        rev_index[uc >> 8][uc & 0xFF] = i;
+
+        struct cp_utf8 *u = &utf8_table[i];
+        if(uc < 0x80)
+        {
+            u->len = 1;
+            u->str[0] = uc;
+        }
+        else if(uc < 0x800)
+        {
+            u->len = 2;
+            u->str[0] = 0xC0 | (uc >> 6);
+            u->str[1] = 0x80 | (uc & 0x3F);
+        }
+        else
+        {
+            u->len = 3;
+            u->str[0] = 0xE0 | (uc >> 12);
+            u->str[1] = 0x80 | ((uc >> 6) & 0x3F);
+            u->str[2] = 0x80 | (uc & 0x3F);
+        }
+    }
+}
+
+/* Builds the tables on first use with the default codepage, this can happen
+ * in the render thread. */
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static inline void check_tables(void)
+{
+    pthread_once(&tables_once, update_tables);
+}
+
 static int read_codepage_file(const char *fname)
 {
     FILE *f = fopen(fname, "r");
@@ -259,6 +314,7 @@ static int read_codepage_file(const char *fname)
     }
     fclose(f);
     cp_table = new_table;
+    update_tables();
     return 1;
 }
 
@@ -274,6 +330,7 @@ void set_codepage(const char *cp_name)
             {
                 debug(debug_dos, "set_codepage: DOS CP set to '%s'\n", names);
                 cp_table = cp->table;
+                update_tables();
                 return;
             }
         }
@@ -311,10 +368,68 @@ int get_unicode(uint8_t cp)
 /* Transforms a Unicode code-point to the DOS char */
 int get_dos_char(int uc)
 {
-    // TODO: faster searching
-    for(int i = 0; i < 256; i++)
-        if(uc == cp_table[i])
-            return i;
+    check_tables();
     // Assume space is always valid
-    return ' ';
+    if(uc < 0 || uc > 0xFFFF)
+        return ' ';
+    return rev_index[uc >> 8][uc & 0xFF];
+}
+
+/* Returns the UTF-8 encoding of a DOS char */
+const struct cp_utf8 *get_utf8(uint8_t cp)
+{
+    check_tables();
+    return &utf8_table[cp];
+}
+
+unsigned cp_to_utf8(char *out, const uint8_t *in, unsigned len, unsigned stride)
+{
+    check_tables();
+    char *p = out;
+    for(unsigned i = 0; i < len; i++, in += stride)
+    {
+        const struct cp_utf8 *u = &utf8_table[*in];
+        // Always copy 3 bytes, only "len" are used
+        memcpy(p, u->str, 3);
+        p += u->len;
+    }
+    return p - out;
+}
+
+/* Length of the UTF-8 sequences from the 5 high bits of the first byte, 0 if
+ * not valid as a first byte. */
+static const uint8_t seq_len[32] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                                    0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0};
+
+unsigned cp_from_utf8(uint8_t *out, const char *in, unsigned len, unsigned *used)
+{
+    check_tables();
+    const uint8_t *s = (const uint8_t *)in;
+    unsigned i = 0, n = 0;
+    while(i < len)
+    {
+        unsigned c = s[i];
+        unsigned l = seq_len[c >> 3];
+        if(!l)
+        {
+            // Invalid lead byte, skip
+            i++;
+            continue;
+        }
+        if(i + l > len)
+            break;
+        unsigned uc = l == 1 ? c : c & (0x7F >> l), k;
+        for(k = 1; k < l && (s[i + k] & 0xC0) == 0x80; k++)
+            uc = (uc << 6) | (s[i + k] & 0x3F);
+        i += k;
+        // Skip sequences with missing continuation bytes
+        if(k < l)
+            continue;
+        if(l == 1)
+            out[n++] = c;
+        else
+            out[n++] = uc > 0xFFFF ? ' ' : rev_index[uc >> 8][uc & 0xFF];
+    }
+    *used = i;
+    return n;
 }
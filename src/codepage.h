@@ -16,3 +16,26 @@ int get_unicode(uint8_t cp);
 
 /* Transforms a Unicode code-point to the DOS char */
 int get_dos_char(int uc);
+
+/* UTF-8 encoding of a DOS char, "len" bytes in "str" */
+struct cp_utf8
+{
+    uint8_t len;
+    char str[3];
+};
+
+/* Returns the UTF-8 encoding of a DOS char */
+const struct cp_utf8 *get_utf8(uint8_t cp);
+
+/* Converts "len" DOS chars, taken each "stride" bytes from "in", to UTF-8.
+ * Returns the number of bytes written to "out", that must have space for
+ * 3 * len bytes.
+ */
+unsigned cp_to_utf8(char *out, const uint8_t *in, unsigned len, unsigned stride);
+
+/* Converts UTF-8 text to DOS chars, returns the number of chars written to
+ * "out", that must have space for "len" chars. Sets "used" to the number of
+ * input bytes converted, an incomplete sequence at the end is not used.
+ * Invalid bytes are skipped.
+ */
+unsigned cp_from_utf8(uint8_t *out, const char *in, unsigned len, unsigned *used);
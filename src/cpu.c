@@ -4,11 +4,13 @@
 #include <unistd.h>
 
 #include "cpu.h"
+#include "cycles.h"
 #include "dbg.h"
 #include "dis.h"
 #include "emu.h"
 #include "env.h"
 #include "os.h"
+#include "replay.h"
 #include "utils.h"
 
 // Forward declarations
@@ -26,15 +28,33 @@ static int8_t CF, PF, ZF, TF, IF, DF;
 /* All the word flags may be either none-zero (true) or zero (false) */
 static unsigned AF, OF, SF;
 
-/* CPU speed: number of instructions to execute each millisecond */
-static unsigned ins_per_ms;
+/* CPU speed: number of cycles to execute each millisecond */
+static unsigned cycles_per_ms;
 
-/* Number of instructions executed in the current time slice */
-static unsigned num_ins_exec;
+/* Cost of each instruction, in cycles */
+static const struct cpu_timing *timing = &cpu_timing_ins;
 
-/* Last time emulator slept */
+/* Length of the throttle time slice, in microseconds and in cycles */
+static unsigned slice_us, cycles_per_slice;
+
+/* Number of cycles executed in the current time slice */
+static unsigned num_cycles;
+
+/* Opcode of the current instruction, used to add memory access costs */
+static uint8_t cur_opcode;
+
+/* End of the current time slice, as an absolute time */
 static EMU_CLOCK_TYPE next_sleep_time;
 
+/* Statistics to report the achieved CPU speed */
+static uint64_t total_cycles;
+static long long total_idle_us;
+static EMU_CLOCK_TYPE start_time;
+
+/* Number of instructions executed, and count to return from execute() */
+static uint64_t ins_count;
+static uint64_t stop_count = UINT64_MAX;
+
 /* Override segment execution */
 static int segment_override;
 
@@ -49,18 +69,23 @@ static uint8_t GetMemAbsB(uint32_t addr)
 
 static uint16_t GetMemAbsW(uint32_t addr)
 {
+    num_cycles += timing->word_bus;
     return memory[addr & 0xFFFFF] + 256 * memory[(addr + 1) & 0xFFFFF];
 }
 
 static void SetMemAbsB(uint32_t addr, uint8_t val)
 {
     memory[0xFFFFF & addr] = val;
+    mark_dirty(0xFFFFF & addr);
 }
 
 static void SetMemAbsW(uint32_t addr, uint16_t x)
 {
+    num_cycles += timing->word_bus;
     memory[addr & 0xFFFFF] = x;
     memory[(addr + 1) & 0xFFFFF] = x >> 8;
+    mark_dirty(addr & 0xFFFFF);
+    mark_dirty((addr + 1) & 0xFFFFF);
 }
 
 static void SetMemB(uint16_t seg, uint16_t off, uint8_t val)
@@ -240,6 +265,64 @@ static uint16_t FETCH_W(void)
 
 #define SET_r16w() SetModRMRegW(ModRM, dest)
 
+// Minimum number of cycles to execute between sleeps, and the
+// limits to the time slice length in milliseconds.
+#define MIN_SLICE_CYCLES 10000
+#define MIN_SLICE_MS  1
+#define MAX_SLICE_MS  10
+// If we are more than this behind the schedule, don't try to catch up.
+#define MAX_LAG_US 100000
+
+static void report_cpu_speed(void)
+{
+    EMU_CLOCK_TYPE now;
+    emu_get_time(&now);
+    long long run_us = emu_diff_time(&now, &start_time) - total_idle_us;
+    uint64_t cycles = total_cycles + num_cycles;
+    if(run_us > 0)
+        debug(debug_int, "cpu speed: target %u %s/ms, achieved %.1f %s/ms in %.3f s\n",
+              cycles_per_ms, timing->unit, cycles * 1000.0 / run_us, timing->unit,
+              run_us / 1000000.0);
+}
+
+static void init_cpu_throttle(void)
+{
+    // Slow CPUs sleep less often, so each slice executes enough cycles to
+    // amortize the cost of the wake-up.
+    unsigned slice_ms = (MIN_SLICE_CYCLES + cycles_per_ms - 1) / cycles_per_ms;
+    if(slice_ms < MIN_SLICE_MS)
+        slice_ms = MIN_SLICE_MS;
+    else if(slice_ms > MAX_SLICE_MS)
+        slice_ms = MAX_SLICE_MS;
+    slice_us = slice_ms * 1000;
+    cycles_per_slice = cycles_per_ms * slice_ms;
+    debug(debug_int, "cpu throttle: %s, %u %s each %u ms\n", timing->name,
+          cycles_per_slice, timing->unit, slice_ms);
+
+    emu_get_time(&start_time);
+    next_sleep_time = start_time;
+    emu_advance_time(slice_us, &next_sleep_time);
+    atexit(report_cpu_speed);
+}
+
+// Sleeps until the end of the current time slice
+static void cpu_throttle(void)
+{
+    debug(debug_cpu, "-- CPU SLEEP --\n");
+    total_cycles += cycles_per_slice;
+    num_cycles -= cycles_per_slice;
+    // The next deadline is computed from the last one and not from the
+    // current time, so any wake-up latency is recovered in the next slice.
+    long long late = emu_sleep_until(&next_sleep_time);
+    if(late > MAX_LAG_US)
+    {
+        debug(debug_int, "cpu throttle: %lld us behind, resetting.\n", late);
+        emu_get_time(&next_sleep_time);
+        total_idle_us += late;
+    }
+    emu_advance_time(slice_us, &next_sleep_time);
+}
+
 void init_cpu(void)
 {
     unsigned i, j, c;
@@ -268,17 +351,29 @@ void init_cpu(void)
     segment_override = NoSeg;
 
     // Read CPU speed vars
-    ins_per_ms = 0;
-    num_ins_exec = 0;
-    if(getenv(ENV_CPUSPEED))
+    cycles_per_ms = 0;
+    num_cycles = 0;
+    if(getenv(ENV_CPUMHZ))
+    {
+        double mhz = atof(getenv(ENV_CPUMHZ));
+        const char *model = getenv(ENV_CPUMODEL) ? getenv(ENV_CPUMODEL) : "8088";
+        timing = get_cpu_timing(model);
+        if(!timing)
+            print_error("unknown CPU model '%s' in %s, use 8088, 8086, 80186 or 80286.\n",
+                        model, ENV_CPUMODEL);
+        // Invalid values map to 0
+        if(mhz >= 0.001 && mhz <= INT_MAX / 2000)
+            cycles_per_ms = mhz * 1000;
+    }
+    else if(getenv(ENV_CPUSPEED))
     {
         unsigned speed = atoi(getenv(ENV_CPUSPEED));
         // Invalid values map to 0
         if(speed >= 1 && speed <= INT_MAX / 2)
-            ins_per_ms = speed;
+            cycles_per_ms = speed;
     }
-    emu_get_time(&next_sleep_time);
-    emu_advance_time(1000, &next_sleep_time);
+    if(cycles_per_ms)
+        init_cpu_throttle();
 }
 
 static uint8_t GetModRMRegB(unsigned ModRM)
@@ -305,6 +400,7 @@ static void SetModRMRegB(unsigned ModRM, uint8_t val)
 // Used on LEA instruction
 static uint16_t GetModRMOffset(unsigned ModRM)
 {
+    num_cycles += timing->ea[((ModRM >> 3) & 0x18) | (ModRM & 7)];
     switch(ModRM & 0xC7)
     {
     case 0x00: return wregs[BX] + wregs[SI];
@@ -337,6 +433,7 @@ static uint16_t GetModRMOffset(unsigned ModRM)
 
 static uint32_t GetModRMAddress(unsigned ModRM)
 {
+    num_cycles += timing->mem[cur_opcode];
     uint16_t disp = GetModRMOffset(ModRM);
     switch(ModRM & 0xC7)
     {
@@ -861,7 +958,10 @@ static void do_cjump(unsigned cond)
 {
     int8_t disp = FETCH_B();
     if(cond)
+    {
         ip = ip + disp;
+        num_cycles += timing->jump;
+    }
 }
 
 static void i_80pre(void)
@@ -1683,6 +1783,7 @@ static void i_c0pre(void)
     uint8_t dest = GetModRMRMB(ModRM);
     uint8_t count = FETCH_B();
 
+    num_cycles += timing->shift * count;
     dest = shifts_b(dest, ModRM, count);
 
     SetModRMRMB(ModRM, dest);
@@ -1694,6 +1795,7 @@ static void i_c1pre(void)
     uint16_t dest = GetModRMRMW(ModRM);
     uint8_t count = FETCH_B();
 
+    num_cycles += timing->shift * count;
     dest = shifts_w(dest, ModRM, count);
 
     SetModRMRMW(ModRM, dest);
@@ -1724,6 +1826,7 @@ static void i_d2pre(void)
     int ModRM = FETCH_B();
     uint8_t dest = GetModRMRMB(ModRM);
 
+    num_cycles += timing->shift * (wregs[CX] & 0xFF);
     dest = shifts_b(dest, ModRM, wregs[CX] & 0xFF);
 
     SetModRMRMB(ModRM, dest);
@@ -1734,6 +1837,7 @@ static void i_d3pre(void)
     int ModRM = FETCH_B();
     uint16_t dest = GetModRMRMW(ModRM);
 
+    num_cycles += timing->shift * (wregs[CX] & 0xFF);
     dest = shifts_w(dest, ModRM, wregs[CX] & 0xFF);
 
     SetModRMRMW(ModRM, dest);
@@ -1793,7 +1897,10 @@ static void i_loopne(void)
     int disp = (int8_t)FETCH_B();
     wregs[CX]--;
     if(!ZF && wregs[CX])
+    {
         ip = ip + disp;
+        num_cycles += timing->jump;
+    }
 }
 
 static void i_loope(void)
@@ -1801,7 +1908,10 @@ static void i_loope(void)
     int disp = (int8_t)FETCH_B();
     wregs[CX]--;
     if(ZF && wregs[CX])
+    {
         ip = ip + disp;
+        num_cycles += timing->jump;
+    }
 }
 
 static void i_loop(void)
@@ -1809,14 +1919,20 @@ static void i_loop(void)
     int disp = (int8_t)FETCH_B();
     wregs[CX]--;
     if(wregs[CX])
+    {
         ip = ip + disp;
+        num_cycles += timing->jump;
+    }
 }
 
 static void i_jcxz(void)
 {
     int disp = (int8_t)FETCH_B();
     if(wregs[CX] == 0)
+    {
         ip = ip + disp;
+        num_cycles += timing->jump;
+    }
 }
 
 static void i_inal(void)
@@ -1900,43 +2016,45 @@ static void i_outdxax(void)
 // Exit a REP early because we need to sleep the CPU
 static void exit_early_rep(uint16_t count)
 {
-    // Reset IP to start of REP sequence, reduce executed instruction count
-    // and stopre CX register.
-    num_ins_exec--;
+    // Reset IP to start of REP sequence and store CX register.
     ip = start_ip;
     wregs[CX] = count;
+    // The instruction will be executed again, don't count it twice
+    ins_count--;
 }
 
 // Executes unconditional REP on the given ins
-#define REP_COUNT(ins) \
-    if(ins_per_ms)                                                 \
-    {                                                              \
-        for(; count > 0; count--)                                  \
-        {                                                          \
-            if(wregs[CX] != count && num_ins_exec++ >= ins_per_ms) \
-                return exit_early_rep(count);                      \
-            ins();                                                 \
-        }                                                          \
-    }                                                              \
-    else                                                           \
-        for(; count > 0; count--)                                  \
-            ins();                                                 \
-    wregs[CX] = count;                                             \
+#define REP_COUNT(ins, cost) \
+    if(cycles_per_ms)                                                 \
+    {                                                                 \
+        for(; count > 0; count--)                                     \
+        {                                                             \
+            if(wregs[CX] != count && num_cycles >= cycles_per_slice)  \
+                return exit_early_rep(count);                         \
+            num_cycles += timing->cost;                               \
+            ins();                                                    \
+        }                                                             \
+    }                                                                 \
+    else                                                              \
+        for(; count > 0; count--)                                     \
+            ins();                                                    \
+    wregs[CX] = count;                                                \
 
 // Executes conditional REP on the given ins
-#define REP_CONDITION(ins) \
-    if(ins_per_ms)                                                 \
-    {                                                              \
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--) \
-        {                                                          \
-            if(wregs[CX] != count && num_ins_exec++ >= ins_per_ms) \
-                return exit_early_rep(count);                      \
-            ins();                                                 \
-        }                                                          \
-    }                                                              \
-    else                                                           \
-        for(ZF = flagval; (ZF == flagval) && (count > 0); count--) \
-            ins();                                                 \
+#define REP_CONDITION(ins, cost) \
+    if(cycles_per_ms)                                                 \
+    {                                                                 \
+        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)    \
+        {                                                             \
+            if(wregs[CX] != count && num_cycles >= cycles_per_slice)  \
+                return exit_early_rep(count);                         \
+            num_cycles += timing->cost;                               \
+            ins();                                                    \
+        }                                                             \
+    }                                                                 \
+    else                                                              \
+        for(ZF = flagval; (ZF == flagval) && (count > 0); count--)    \
+            ins();                                                    \
     wregs[CX] = count;
 
 static void rep(int flagval)
@@ -1969,46 +2087,46 @@ static void rep(int flagval)
         segment_override = NoSeg;
         break;
     case 0x6c: /* REP INSB */
-        REP_COUNT(i_insb);
+        REP_COUNT(i_insb, rep_ins);
         break;
     case 0x6d: /* REP INSW */
-        REP_COUNT(i_insw);
+        REP_COUNT(i_insw, rep_ins);
         break;
     case 0x6e: /* REP OUTSB */
-        REP_COUNT(i_outsb);
+        REP_COUNT(i_outsb, rep_outs);
         break;
     case 0x6f: /* REP OUTSW */
-        REP_COUNT(i_outsw);
+        REP_COUNT(i_outsw, rep_outs);
         break;
     case 0xa4: /* REP MOVSB */
-        REP_COUNT(i_movsb);
+        REP_COUNT(i_movsb, rep_movs);
         break;
     case 0xa5: /* REP MOVSW */
-        REP_COUNT(i_movsw);
+        REP_COUNT(i_movsw, rep_movs);
         break;
     case 0xa6: /* REP(N)E CMPSB */
-        REP_CONDITION(i_cmpsb);
+        REP_CONDITION(i_cmpsb, rep_cmps);
         break;
     case 0xa7: /* REP(N)E CMPSW */
-        REP_CONDITION(i_cmpsw);
+        REP_CONDITION(i_cmpsw, rep_cmps);
         break;
     case 0xaa: /* REP STOSB */
-        REP_COUNT(i_stosb);
+        REP_COUNT(i_stosb, rep_stos);
         break;
     case 0xab: /* REP LODSW */
-        REP_COUNT(i_stosw);
+        REP_COUNT(i_stosw, rep_stos);
         break;
     case 0xac: /* REP LODSB */
-        REP_COUNT(i_lodsb);
+        REP_COUNT(i_lodsb, rep_lods);
         break;
     case 0xad: /* REP LODSW */
-        REP_COUNT(i_lodsw);
+        REP_COUNT(i_lodsw, rep_lods);
         break;
     case 0xae: /* REP(N)E SCASB */
-        REP_CONDITION(i_scasb);
+        REP_CONDITION(i_scasb, rep_scas);
         break;
     case 0xaf: /* REP(N)E SCASW */
-        REP_CONDITION(i_scasw);
+        REP_CONDITION(i_scasw, rep_scas);
         break;
     default: /* Ignore REP */
         do_instruction(next);
@@ -2018,6 +2136,7 @@ static void rep(int flagval)
 static void i_f6pre(void)
 {
     int ModRM = FETCH_B();
+    num_cycles += timing->grp[0][(ModRM >> 3) & 7];
     uint8_t dest = GetModRMRMB(ModRM);
 
     switch(ModRM & 0x38)
@@ -2091,6 +2210,7 @@ static void i_f6pre(void)
 static void i_f7pre(void)
 {
     int ModRM = FETCH_B();
+    num_cycles += timing->grp[1][(ModRM >> 3) & 7];
     uint16_t dest = GetModRMRMW(ModRM);
 
     switch(ModRM & 0x38)
@@ -2216,6 +2336,7 @@ static void i_bound(void)
 static void i_fepre(void)
 {
     int ModRM = FETCH_B();
+    num_cycles += timing->grp[2][(ModRM >> 3) & 7];
     uint8_t dest = GetModRMRMB(ModRM);
 
     if((ModRM & 0x38) == 0)
@@ -2239,6 +2360,7 @@ static void i_fepre(void)
 static void i_ffpre(void)
 {
     int ModRM = FETCH_B();
+    num_cycles += timing->grp[3][(ModRM >> 3) & 7];
     uint16_t dest = GetModRMRMW(ModRM);
 
     switch(ModRM & 0x38)
@@ -2334,6 +2456,8 @@ static void do_instruction(uint8_t code)
 {
     if(debug_active(debug_cpu) && segment_override == NoSeg)
         debug_instruction();
+    cur_opcode = code;
+    num_cycles += timing->op[code];
     switch(code)
     {
     case 0x00: OP_br8(ADD);
@@ -2597,38 +2721,58 @@ static void do_instruction(uint8_t code)
 
 void execute(void)
 {
-    for(; !exit_cpu;)
+    for(; !exit_cpu && ins_count != stop_count; ins_count++)
     {
-        if(ins_per_ms)
-        {
-            // Slowdown CPU count
-            if(num_ins_exec++ >= ins_per_ms)
-            {
-                debug(debug_cpu, "-- CPU SLEEP --\n");
-                while(!emu_compare_time(&next_sleep_time))
-                    usleep(500);
-                // Advance next sleep 1ms
-                emu_advance_time(1000, &next_sleep_time);
-                num_ins_exec -= ins_per_ms;
-            }
-        }
+        // Slowdown CPU count
+        if(cycles_per_ms && num_cycles >= cycles_per_slice)
+            cpu_throttle();
         handle_irq();
         next_instruction();
     }
 }
 
+uint64_t cpu_get_ins_count(void)
+{
+    return ins_count;
+}
+
+void cpu_set_stop_count(uint64_t count)
+{
+    stop_count = count;
+}
+
 // Sleeps and advances next CPU time slice
-void cpu_usleep(int us)
+static void sleep_us(int us)
 {
     usleep(us);
-    // Restart the clock after the sleep, recalculating next CPU sleep time
-    if(ins_per_ms)
+}
+
+void cpu_usleep(int us)
+{
+    cpu_wait(us, sleep_us);
+}
+
+void cpu_wait(int us, void (*wait)(int us))
+{
+    // On replay, all the inputs are already known, don't wait for them
+    if(replay_active())
+        return;
+    if(!cycles_per_ms)
     {
-        emu_get_time(&next_sleep_time);
-        if(num_ins_exec < ins_per_ms)
-            emu_advance_time(1000 - 1000 * num_ins_exec / ins_per_ms, &next_sleep_time);
-        num_ins_exec = 0;
+        wait(us);
+        return;
     }
+    // Restart the clock after the sleep, recalculating next CPU sleep time
+    EMU_CLOCK_TYPE before;
+    emu_get_time(&before);
+    wait(us);
+    emu_get_time(&next_sleep_time);
+    total_idle_us += emu_diff_time(&next_sleep_time, &before);
+    if(num_cycles < cycles_per_slice)
+        emu_advance_time(slice_us - (uint64_t)slice_us * num_cycles / cycles_per_slice,
+                         &next_sleep_time);
+    total_cycles += num_cycles;
+    num_cycles = 0;
 }
 
 // Set CPU registers from outside
@@ -0,0 +1,206 @@
+#include "cycles.h"
+
+#include <string.h>
+#include <strings.h>
+
+// Instruction timings, from the Intel data-sheets. When an instruction has a
+// variable cost we use an average value.
+
+static const uint8_t op_ins[256] = {
+    /* 00 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 10 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 20 */ 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1,
+    /* 30 */ 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0, 1,
+    /* 40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 80 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 90 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* A0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* B0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* C0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* D0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* E0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* F0 */ 0, 1, 0, 0, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 0, 0,
+};
+
+static const uint8_t op_none[256] = {0};
+
+static const uint8_t ea_none[32] = {0};
+
+static const uint8_t op_8086[256] = {
+    /* 00 */ 3, 3, 3, 3, 4, 4, 10, 8, 3, 3, 3, 3, 4, 4, 10, 8,
+    /* 10 */ 3, 3, 3, 3, 4, 4, 10, 8, 3, 3, 3, 3, 4, 4, 10, 8,
+    /* 20 */ 3, 3, 3, 3, 4, 4, 2, 4, 3, 3, 3, 3, 4, 4, 2, 4,
+    /* 30 */ 3, 3, 3, 3, 4, 4, 2, 8, 3, 3, 3, 3, 4, 4, 2, 8,
+    /* 40 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    /* 50 */ 11, 11, 11, 11, 11, 11, 11, 11, 8, 8, 8, 8, 8, 8, 8, 8,
+    /* 60 */ 36, 51, 33, 2, 2, 2, 2, 2, 10, 22, 10, 22, 14, 14, 14, 14,
+    /* 70 */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* 80 */ 4, 4, 4, 4, 3, 3, 4, 4, 2, 2, 2, 2, 2, 2, 2, 8,
+    /* 90 */ 3, 3, 3, 3, 3, 3, 3, 3, 2, 5, 28, 3, 10, 8, 4, 4,
+    /* A0 */ 10, 10, 10, 10, 18, 18, 22, 22, 4, 4, 11, 11, 12, 12, 15, 15,
+    /* B0 */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* C0 */ 8, 8, 12, 8, 16, 16, 4, 4, 15, 8, 17, 18, 52, 51, 4, 24,
+    /* D0 */ 2, 2, 8, 8, 83, 60, 4, 11, 2, 2, 2, 2, 2, 2, 2, 2,
+    /* E0 */ 5, 5, 5, 5, 10, 10, 10, 10, 19, 15, 15, 15, 8, 8, 8, 8,
+    /* F0 */ 2, 2, 9, 9, 2, 2, 0, 0, 2, 2, 2, 2, 2, 2, 0, 0,
+};
+
+static const uint8_t mem_8086[256] = {
+    /* 00 */ 13, 13, 6, 6, 0, 0, 0, 0, 13, 13, 6, 6, 0, 0, 0, 0,
+    /* 10 */ 13, 13, 6, 6, 0, 0, 0, 0, 13, 13, 6, 6, 0, 0, 0, 0,
+    /* 20 */ 13, 13, 6, 6, 0, 0, 0, 0, 13, 13, 6, 6, 0, 0, 0, 0,
+    /* 30 */ 13, 13, 6, 6, 0, 0, 0, 0, 6, 6, 6, 6, 0, 0, 0, 0,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 0, 7, 0, 0, 0, 0,
+    /* 70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 80 */ 13, 13, 13, 13, 6, 6, 13, 13, 7, 7, 6, 6, 7, 0, 6, 9,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 12, 12, 0, 0, 0, 0, 6, 6, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 13, 13, 12, 12, 0, 0, 0, 0, 6, 6, 6, 6, 6, 6, 6, 6,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, 8, 8, 0, 0, 0, 0, 0, 0, 12, 6,
+};
+
+static const uint8_t ea_8086[32] = {
+    7, 8, 8, 7, 5, 5, 6, 5,     // [BX+SI] ... [BX]
+    11, 12, 12, 11, 9, 9, 9, 9, // [BX+SI+d8] ... [BX+d8]
+    11, 12, 12, 11, 9, 9, 9, 9, // [BX+SI+d16] ... [BX+d16]
+    0, 0, 0, 0, 0, 0, 0, 0,     // Registers
+};
+
+static const uint8_t op_80186[256] = {
+    /* 00 */ 3, 3, 3, 3, 4, 4, 9, 8, 3, 3, 3, 3, 4, 4, 9, 8,
+    /* 10 */ 3, 3, 3, 3, 4, 4, 9, 8, 3, 3, 3, 3, 4, 4, 9, 8,
+    /* 20 */ 3, 3, 3, 3, 4, 4, 2, 4, 3, 3, 3, 3, 4, 4, 2, 4,
+    /* 30 */ 3, 3, 3, 3, 4, 4, 2, 8, 3, 3, 3, 3, 4, 4, 2, 8,
+    /* 40 */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    /* 50 */ 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    /* 60 */ 36, 51, 33, 2, 2, 2, 2, 2, 10, 22, 10, 22, 14, 14, 14, 14,
+    /* 70 */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* 80 */ 4, 4, 4, 4, 3, 3, 4, 4, 2, 2, 2, 2, 2, 6, 2, 10,
+    /* 90 */ 3, 3, 3, 3, 3, 3, 3, 3, 2, 4, 23, 6, 9, 8, 3, 2,
+    /* A0 */ 9, 9, 9, 9, 14, 14, 22, 22, 4, 4, 10, 10, 12, 12, 15, 15,
+    /* B0 */ 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* C0 */ 5, 5, 18, 16, 18, 18, 4, 4, 15, 8, 25, 22, 45, 47, 4, 28,
+    /* D0 */ 2, 2, 5, 5, 19, 15, 3, 11, 6, 6, 6, 6, 6, 6, 6, 6,
+    /* E0 */ 5, 5, 5, 5, 10, 10, 9, 9, 15, 14, 14, 13, 8, 8, 7, 7,
+    /* F0 */ 2, 2, 8, 8, 2, 2, 0, 0, 2, 2, 2, 2, 2, 2, 0, 0,
+};
+
+static const uint8_t mem_80186[256] = {
+    /* 00 */ 7, 7, 7, 7, 0, 0, 0, 0, 7, 7, 7, 7, 0, 0, 0, 0,
+    /* 10 */ 7, 7, 7, 7, 0, 0, 0, 0, 7, 7, 7, 7, 0, 0, 0, 0,
+    /* 20 */ 7, 7, 7, 7, 0, 0, 0, 0, 7, 7, 7, 7, 0, 0, 0, 0,
+    /* 30 */ 7, 7, 7, 7, 0, 0, 0, 0, 7, 7, 7, 7, 0, 0, 0, 0,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 0, 7, 0, 0, 0, 0,
+    /* 70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 80 */ 12, 12, 12, 12, 7, 7, 13, 13, 10, 10, 7, 7, 10, 0, 7, 10,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 12, 12, 0, 0, 0, 0, 9, 9, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 13, 13, 12, 12, 0, 0, 0, 0, 6, 6, 6, 6, 6, 6, 6, 6,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, 6, 6, 0, 0, 0, 0, 0, 0, 12, 6,
+};
+
+static const uint8_t op_80286[256] = {
+    /* 00 */ 2, 2, 2, 2, 3, 3, 3, 5, 2, 2, 2, 2, 3, 3, 3, 5,
+    /* 10 */ 2, 2, 2, 2, 3, 3, 3, 5, 2, 2, 2, 2, 3, 3, 3, 5,
+    /* 20 */ 2, 2, 2, 2, 3, 3, 0, 3, 2, 2, 2, 2, 3, 3, 0, 3,
+    /* 30 */ 2, 2, 2, 2, 3, 3, 0, 3, 2, 2, 2, 2, 3, 3, 0, 3,
+    /* 40 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    /* 50 */ 3, 3, 3, 3, 3, 3, 3, 3, 5, 5, 5, 5, 5, 5, 5, 5,
+    /* 60 */ 17, 19, 13, 2, 2, 2, 2, 2, 3, 21, 3, 21, 5, 5, 5, 5,
+    /* 70 */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    /* 80 */ 3, 3, 3, 3, 2, 2, 3, 3, 2, 2, 2, 2, 2, 3, 2, 5,
+    /* 90 */ 3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 13, 3, 3, 5, 2, 2,
+    /* A0 */ 5, 5, 5, 5, 5, 5, 8, 8, 3, 3, 3, 3, 5, 5, 7, 7,
+    /* B0 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    /* C0 */ 5, 5, 11, 11, 7, 7, 2, 2, 11, 5, 15, 15, 23, 23, 3, 17,
+    /* D0 */ 2, 2, 5, 5, 16, 14, 2, 5, 2, 2, 2, 2, 2, 2, 2, 2,
+    /* E0 */ 4, 4, 4, 4, 5, 5, 3, 3, 7, 7, 11, 7, 5, 5, 3, 3,
+    /* F0 */ 0, 2, 5, 5, 2, 2, 0, 0, 2, 2, 2, 2, 2, 2, 0, 0,
+};
+
+static const uint8_t mem_80286[256] = {
+    /* 00 */ 5, 5, 5, 5, 0, 0, 0, 0, 5, 5, 5, 5, 0, 0, 0, 0,
+    /* 10 */ 5, 5, 5, 5, 0, 0, 0, 0, 5, 5, 5, 5, 0, 0, 0, 0,
+    /* 20 */ 5, 5, 5, 5, 0, 0, 0, 0, 5, 5, 5, 5, 0, 0, 0, 0,
+    /* 30 */ 5, 5, 5, 5, 0, 0, 0, 0, 4, 4, 5, 5, 0, 0, 0, 0,
+    /* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 3, 0, 0, 0, 0,
+    /* 70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 80 */ 4, 4, 4, 4, 4, 4, 2, 2, 1, 1, 3, 3, 1, 0, 3, 0,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* A0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* B0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* C0 */ 3, 3, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ 5, 5, 3, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* E0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* F0 */ 0, 0, 0, 0, 0, 0, 3, 3, 0, 0, 0, 0, 0, 0, 5, 4,
+};
+
+static const uint8_t ea_80286[32] = {
+    0, 0, 0, 0, 0, 0, 0, 0, //
+    1, 1, 1, 1, 0, 0, 0, 0, // Base + index + displacement takes one cycle
+    1, 1, 1, 1, 0, 0, 0, 0, //
+    0, 0, 0, 0, 0, 0, 0, 0, // Registers
+};
+
+const struct cpu_timing cpu_timing_ins = {
+    "ins", "ins", op_ins, op_none, ea_none,
+    {{1, 1, 1, 1, 1, 1, 1, 1},
+     {1, 1, 1, 1, 1, 1, 1, 1},
+     {1, 1, 1, 1, 1, 1, 1, 1},
+     {1, 1, 1, 1, 1, 1, 1, 1}},
+    1, 1, 1, 1, 1, 1, 1, 0, 0, 0
+};
+
+static const struct cpu_timing cpu_timings[] = {
+    {"8088", "cycles", op_8086, mem_8086, ea_8086,
+     {{5, 5, 3, 3, 74, 89, 85, 106},
+      {5, 5, 3, 3, 128, 140, 153, 174},
+      {3, 3, 3, 3, 3, 3, 3, 3},
+      {2, 2, 16, 37, 11, 24, 16, 2}},
+     17, 22, 10, 13, 15, 8, 8, 12, 4, 4},
+    {"8086", "cycles", op_8086, mem_8086, ea_8086,
+     {{5, 5, 3, 3, 74, 89, 85, 106},
+      {5, 5, 3, 3, 128, 140, 153, 174},
+      {3, 3, 3, 3, 3, 3, 3, 3},
+      {2, 2, 16, 37, 11, 24, 16, 2}},
+     17, 22, 10, 13, 15, 8, 8, 12, 4, 0},
+    {"80186", "cycles", op_80186, mem_80186, ea_none,
+     {{4, 4, 3, 3, 27, 27, 29, 48},
+      {4, 4, 3, 3, 36, 36, 38, 57},
+      {3, 3, 3, 3, 3, 3, 3, 3},
+      {3, 3, 13, 38, 11, 26, 16, 3}},
+     8, 22, 9, 11, 15, 8, 8, 9, 1, 0},
+    {"80286", "cycles", op_80286, mem_80286, ea_80286,
+     {{2, 2, 2, 2, 13, 13, 14, 17},
+      {2, 2, 2, 2, 21, 21, 22, 25},
+      {2, 2, 2, 2, 2, 2, 2, 2},
+      {2, 2, 7, 16, 7, 15, 5, 2}},
+     4, 9, 3, 4, 8, 4, 5, 4, 1, 0},
+    {0}
+};
+
+const struct cpu_timing *get_cpu_timing(const char *model)
+{
+    // Allow the "i" prefix, as in "i8088"
+    if(model[0] == 'i' || model[0] == 'I')
+        model++;
+    for(const struct cpu_timing *t = cpu_timings; t->name; t++)
+        if(!strcasecmp(model, t->name) || !strcasecmp(model, t->name + 2))
+            return t;
+    return 0;
+}
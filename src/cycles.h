@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Cost of each instruction, used to limit the emulated CPU speed */
+struct cpu_timing
+{
+    const char *name;
+    const char *unit;   // Unit of the costs, for the speed report
+    const uint8_t *op;  // Cost of each opcode with register operands
+    const uint8_t *mem; // Extra cost of each opcode with a memory operand
+    const uint8_t *ea;  // Cost of the effective address, indexed by mod * 8 + r/m
+    uint8_t grp[4][8];  // Cost of opcodes F6, F7, FE and FF, by the reg field
+    uint8_t rep_movs, rep_cmps, rep_stos, rep_lods, rep_scas, rep_ins, rep_outs;
+    uint8_t jump;       // Extra cost of taken conditional jumps and loops
+    uint8_t shift;      // Cost of each bit shifted by a count
+    uint8_t word_bus;   // Extra cost of each 16 bit memory access
+};
+
+/* Timing that counts each instruction as one unit */
+extern const struct cpu_timing cpu_timing_ins;
+
+/* Returns the timing of the given CPU model, or null if not known */
+const struct cpu_timing *get_cpu_timing(const char *model);
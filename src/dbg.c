@@ -45,9 +45,30 @@ NORETURN void print_usage(void)
            "  %-18s  Limit DOS memory to 512KB, fixes some old buggy programs.\n"
            "  %-18s  Specifies a DOS append paths, separated by ';'.\n"
            "  %-18s  Set version of DOS to emulate, e.g. '2.11', '3.20', etc.\n"
-           "  %-18s  Setup text mode with given number of rows, from 12 to 50.\n",
+           "  %-18s  Setup text mode with given number of rows, from 12 to 50.\n"
+           "  %-18s  Limit emulated CPU speed to the given MHz.\n"
+           "  %-18s  CPU timings to use with the above, from the following:\n"
+           "\t\t      '8088' (default), '8086', '80186', '80286'.\n"
+           "  %-18s  Record the keyboard and clock inputs to the given file.\n"
+           "  %-18s  Replay the inputs from a file written with the above.\n"
+           "  %-18s  Set to 1 to use synchronized terminal updates.\n"
+           "  %-18s  Maximum number of screen updates per second.\n"
+           "  %-18s  Set to 1 to run without a terminal, keeping the screen\n"
+           "\t\t      only in the emulated video memory.\n"
+           "  %-18s  Write the final screen to the given file, '-' for stdout.\n"
+           "  %-18s  Set to 1 to include the colors in the screen dump.\n"
+           "  %-18s  Read the keyboard input from the given file or pipe.\n"
+           "  %-18s  Record the terminal output to the given asciicast file.\n"
+           "  %-18s  Export the emulated memory and screen state to the shared\n"
+           "\t\t      memory object with the given name.\n"
+           "  %-18s  Type the keys from the given file when the program waits\n"
+           "\t\t      for input, use <name> for special keys, e.g. <F1>, and\n"
+           "\t\t      <wait:text> to wait for a text in the screen.\n",
            prog_name, ENV_DBG_NAME, ENV_DBG_OPT, ENV_PROGNAME, ENV_DEF_DRIVE, ENV_CWD,
-           ENV_DRIVE "n", ENV_CODEPAGE, ENV_LOWMEM, ENV_APPEND, ENV_DOSVER, ENV_ROWS);
+           ENV_DRIVE "n", ENV_CODEPAGE, ENV_LOWMEM, ENV_APPEND, ENV_DOSVER, ENV_ROWS,
+           ENV_CPUMHZ, ENV_CPUMODEL, ENV_RECORD, ENV_REPLAY,
+           ENV_TERMSYNC, ENV_FPS, ENV_HEADLESS, ENV_DUMP, ENV_DUMP_ANSI, ENV_KEYB_FILE,
+           ENV_CAST, ENV_SHM, ENV_KEYS);
     exit(EXIT_SUCCESS);
 }
 
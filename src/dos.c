@@ -7,6 +7,9 @@
 #include "keyb.h"
 #include "loader.h"
 #include "os.h"
+#include "rawfile.h"
+#include "replay.h"
+#include "shm.h"
 #include "timer.h"
 #include "utils.h"
 #include "video.h"
@@ -60,10 +63,193 @@ static uint32_t get_static_memory(uint16_t bytes, uint16_t align)
     return current - bytes;
 }
 
-// DOS file handles
+// DOS file handles: each handle in the job file table (JFT) points to an
+// entry in the system file table (SFT), shared by all the duplicates of the
+// handle. Both tables grow as needed, the free SFT entries are kept in a list.
+// Regular files use the raw file backend, devices and the standard streams
+// use stdio.
 #define max_handles (0x10000)
-static FILE *handles[max_handles];
-static uint16_t devinfo[max_handles];
+struct dos_file
+{
+    FILE *f;
+    struct rawfile *rf;
+    uint16_t devinfo;
+    int refs;      // Number of handles pointing to this entry
+    int next_free; // Next free entry, if not used
+};
+static struct dos_file *sft;
+static unsigned sft_size;
+static int sft_free = -1;
+static int *jft;
+static unsigned jft_size;
+// All the handles before this one are in use
+static unsigned jft_first_free;
+
+// Returns the file table entry of a handle, or NULL if not open
+static struct dos_file *get_handle(unsigned h)
+{
+    if(h >= jft_size || jft[h] < 0)
+        return 0;
+    return &sft[jft[h]];
+}
+
+static uint16_t handle_devinfo(unsigned h)
+{
+    struct dos_file *d = get_handle(h);
+    return d ? d->devinfo : 0;
+}
+
+// Grows the JFT to include the given handle
+static void grow_jft(unsigned h)
+{
+    if(h < jft_size)
+        return;
+    unsigned size = jft_size ? jft_size : 20;
+    while(size <= h)
+        size *= 2;
+    if(size > max_handles)
+        size = max_handles;
+    jft = realloc(jft, size * sizeof(*jft));
+    if(!jft)
+        print_error("out of memory allocating file handles.\n");
+    for(unsigned i = jft_size; i < size; i++)
+        jft[i] = -1;
+    jft_size = size;
+}
+
+// Assigns a new SFT entry with the given file to the handle
+static void set_handle(unsigned h, FILE *f, struct rawfile *rf, uint16_t devinfo)
+{
+    if(sft_free < 0)
+    {
+        unsigned size = sft_size ? sft_size * 2 : 20;
+        sft = realloc(sft, size * sizeof(*sft));
+        if(!sft)
+            print_error("out of memory allocating file handles.\n");
+        for(unsigned i = sft_size; i < size; i++)
+            sft[i].next_free = i + 1 < size ? (int)i + 1 : -1;
+        sft_free = sft_size;
+        sft_size = size;
+    }
+    int i = sft_free;
+    sft_free = sft[i].next_free;
+    sft[i].f = f;
+    sft[i].rf = rf;
+    sft[i].devinfo = devinfo;
+    sft[i].refs = 1;
+    grow_jft(h);
+    jft[h] = i;
+}
+
+// Makes handle "h" point to the same file as handle "old"
+static void dup_handle(unsigned h, unsigned old)
+{
+    grow_jft(h);
+    jft[h] = jft[old];
+    sft[jft[h]].refs++;
+}
+
+// Opens a host file for a DOS handle, returns 0 on error.
+static int open_file(const char *fname, int flags, const char *mode, struct dos_file *d)
+{
+    d->f = 0;
+    d->rf = 0;
+    int fd = open(fname, flags, 0666);
+    if(fd == -1)
+        return 0;
+    // Check if we opened a directory and fail
+    struct stat st;
+    if(0 != fstat(fd, &st) || S_ISDIR(st.st_mode))
+        close(fd);
+    else if(S_ISREG(st.st_mode))
+        d->rf = rawfile_open(fd, (flags & O_ACCMODE) == O_RDONLY);
+    else
+        d->f = fdopen(fd, mode);
+    return d->f || d->rf;
+}
+
+static unsigned file_read(struct dos_file *d, uint8_t *buf, unsigned len)
+{
+    if(d->rf)
+        return rawfile_read(d->rf, buf, len);
+    return fread(buf, 1, len, d->f);
+}
+
+static unsigned file_write(struct dos_file *d, const uint8_t *buf, unsigned len)
+{
+    if(d->rf)
+        return rawfile_write(d->rf, buf, len);
+    return fwrite(buf, 1, len, d->f);
+}
+
+// Reads one byte, returns EOF at end of file
+static int file_getc(struct dos_file *d)
+{
+    uint8_t c;
+    if(d->rf)
+        return rawfile_read(d->rf, &c, 1) ? c : EOF;
+    return getc(d->f);
+}
+
+// Seeks, returning the new position, or the old one on error
+static long file_seek(struct dos_file *d, long pos, int whence)
+{
+    if(d->rf)
+    {
+        off_t p = rawfile_seek(d->rf, pos, whence);
+        return p != -1 ? p : rawfile_seek(d->rf, 0, SEEK_CUR);
+    }
+    fseek(d->f, pos, whence);
+    return ftell(d->f);
+}
+
+// Flushes the file and truncates at the current position
+static int file_truncate(struct dos_file *d)
+{
+    if(d->rf)
+        return rawfile_truncate(d->rf);
+    if(fflush(d->f))
+        return -1;
+    if(d->devinfo != 0x80D3)
+    {
+        off_t pos = ftello(d->f);
+        if(pos != -1 && -1 == ftruncate(fileno(d->f), pos))
+            return -1;
+    }
+    return 0;
+}
+
+static int file_eof(struct dos_file *d)
+{
+    return d->rf ? rawfile_eof(d->rf) : feof(d->f);
+}
+
+static int file_fd(struct dos_file *d)
+{
+    return d->rf ? rawfile_fd(d->rf) : fileno(d->f);
+}
+
+// Writes the buffered data of all files at exit
+static void flush_files(void)
+{
+    for(unsigned i = 0; i < sft_size; i++)
+        if(sft[i].rf && sft[i].refs > 0)
+            rawfile_flush(sft[i].rf);
+}
+
+// Shares the positions of the open files with a child process, with "in" set
+// after it exits.
+static void sync_files(int in)
+{
+    for(unsigned i = 0; i < sft_size; i++)
+        if(sft[i].rf && sft[i].refs > 0)
+        {
+            if(in)
+                rawfile_sync_in(sft[i].rf);
+            else
+                rawfile_sync_out(sft[i].rf);
+        }
+}
 
 static uint16_t guess_devinfo(FILE *f)
 {
@@ -80,44 +266,56 @@ static uint16_t guess_devinfo(FILE *f)
 
 static void init_handles(void)
 {
-    handles[0] = stdin;
-    handles[1] = stdout;
-    handles[2] = stderr;
-    handles[3] = stderr; // AUX
-    handles[4] = stderr; // PRN
     // stdin,stdout,stderr: special, eof on input, is device
-    for(int i = 0; i < 3; i++)
-        devinfo[i] = guess_devinfo(handles[i]);
+    set_handle(0, stdin, 0, guess_devinfo(stdin));
+    set_handle(1, stdout, 0, guess_devinfo(stdout));
+    set_handle(2, stderr, 0, guess_devinfo(stderr));
+    set_handle(3, stderr, 0, 0); // AUX
+    set_handle(4, stderr, 0, 0); // PRN
+    jft_first_free = 5;
+    atexit(flush_files);
 }
 
+// Returns the lowest free handle, as DOS does
 static int get_new_handle(void)
 {
-    int i;
-    for(i = 0; i < max_handles; i++)
-        if(!handles[i])
-            return i;
-    return -1;
+    unsigned h = jft_first_free;
+    while(h < jft_size && jft[h] >= 0)
+        h++;
+    if(h >= max_handles)
+        return -1;
+    jft_first_free = h;
+    return h;
 }
 
 static int dos_close_file(int h)
 {
-    FILE *f = handles[h];
-    if(!f)
+    struct dos_file *d = get_handle(h);
+    if(!d)
     {
         cpuSetFlag(cpuFlag_CF);
         cpuSetAX(6);
         dos_error = 6;
         return -1;
     }
-    handles[h] = 0;
-    devinfo[h] = 0;
+    jft[h] = -1;
+    if((unsigned)h < jft_first_free)
+        jft_first_free = h;
     cpuClrFlag(cpuFlag_CF);
-    for(int i = 0; i < max_handles; i++)
-        if(handles[i] == f)
-            return 0; // Still referenced, don't really close
-    if(f == stdin || f == stdout || f == stderr)
+    if(--d->refs)
+        return 0; // Still referenced, don't really close
+    FILE *f = d->f;
+    struct rawfile *rf = d->rf;
+    d->f = 0;
+    d->rf = 0;
+    d->next_free = sft_free;
+    sft_free = d - sft;
+    if(rf)
+        rawfile_close(rf);
+    else if(f == stdin || f == stdout || f == stderr)
         return 0; // Never close standard streams
-    fclose(f);
+    else
+        fclose(f);
     dos_error = 0;
     return 0;
 }
@@ -227,19 +425,8 @@ static int dos_open_file(int create, int access_mode, int name_addr)
     debug(debug_dos, "\topen '%s', '%s', %04x ", fname, mode, (unsigned)h);
 
     // TODO: should set file attributes in CX
-    handles[h] = 0;
-    int fd = open(fname, mflag, 0666);
-    if(fd != -1)
-    {
-        // Check if we opened a directory and fail
-        struct stat st;
-        if(0 != fstat(fd, &st) || S_ISDIR(st.st_mode))
-            close(fd);
-        else
-            handles[h] = fdopen(fd, mode);
-    }
-
-    if(!handles[h])
+    struct dos_file file;
+    if(!open_file(fname, mflag, mode, &file))
     {
         if(errno != ENOENT)
         {
@@ -258,19 +445,19 @@ static int dos_open_file(int create, int access_mode, int name_addr)
     }
     // Set device info:
     if(!strcmp(fname, "/dev/null"))
-        devinfo[h] = 0x80C4;
+        set_handle(h, file.f, file.rf, 0x80C4);
     else if(!strcmp(fname, "/dev/tty"))
-        devinfo[h] = 0x80D3;
+        set_handle(h, file.f, file.rf, 0x80D3);
     else if(memory[name_addr + 1] == ':')
     {
         uint8_t c = memory[name_addr];
         c = (c >= 'a') ? c - 'a' : c - 'A';
         if(c > 26)
             c = dos_get_default_drive();
-        devinfo[h] = 0x0000 + c;
+        set_handle(h, file.f, file.rf, 0x0000 + c);
     }
     else
-        devinfo[h] = 0x0000 + dos_get_default_drive();
+        set_handle(h, file.f, file.rf, 0x0000 + dos_get_default_drive());
     debug(debug_dos, "OK.\n");
     cpuClrFlag(cpuFlag_CF);
     cpuSetAX(h);
@@ -332,8 +519,8 @@ static void dos_open_file_fcb(int create)
     }
     const char *mode = create ? "w+b" : "r+b";
     debug(debug_dos, "\topen fcb '%s', '%s', %04x ", fname, mode, (unsigned)h);
-    handles[h] = fopen(fname, mode);
-    if(!handles[h])
+    struct dos_file file;
+    if(!open_file(fname, create ? O_CREAT | O_TRUNC | O_RDWR : O_RDWR, mode, &file))
     {
         dos_error = 4;
         debug(debug_dos, "%s.\n", strerror(errno));
@@ -342,10 +529,10 @@ static void dos_open_file_fcb(int create)
         free(fname);
         return;
     }
+    set_handle(h, file.f, file.rf, 0);
     // Get file size
-    fseek(handles[h], 0, SEEK_END);
-    long sz = ftell(handles[h]);
-    fseek(handles[h], 0, SEEK_SET);
+    long sz = file_seek(get_handle(h), 0, SEEK_END);
+    file_seek(get_handle(h), 0, SEEK_SET);
     // Set FCB info:
     put16(fcb_addr + 0x0C, 0);   // block number
     put16(fcb_addr + 0x0E, 128); // record size
@@ -383,8 +570,8 @@ static void dos_seq_to_rand_fcb(int fcb)
 
 static int dos_rw_record_fcb(unsigned addr, int write, int update, int seq)
 {
-    FILE *f = handles[get_fcb_handle()];
-    if(!f)
+    struct dos_file *d = get_handle(get_fcb_handle());
+    if(!d)
     {
         dos_error = 6;
         return 1; // no data read/write
@@ -413,10 +600,12 @@ static int dos_rw_record_fcb(unsigned addr, int write, int update, int seq)
         return 2; // segment wrap in DTA
     }
     // Seek to block and read
-    if(fseek(f, pos, SEEK_SET))
+    if(file_seek(d, pos, SEEK_SET) != pos)
         return 1; // no data read
     // Read / Write
-    unsigned n = write ? fwrite(buf, 1, rsize, f) : fread(buf, 1, rsize, f);
+    unsigned n = write ? file_write(d, buf, rsize) : file_read(d, buf, rsize);
+    if(!write)
+        mark_dirty_range(addr, n);
     // Update random and block positions
     if(update)
     {
@@ -637,7 +826,7 @@ static void dos_find_next(int first)
         {
             // Fills volume label data
             memory[dosDTA + 0x15] = 8;
-            put32(dosDTA + 0x16, get_time_date(time(0)));
+            put32(dosDTA + 0x16, get_time_date(replay_time()));
             put32(dosDTA + 0x1A, 0);
         }
         // Fills dos file name
@@ -720,7 +909,7 @@ static void dos_find_next_fcb(void)
         else
         {
             memory[ofcb + 0x0C] = 8;
-            put32(ofcb + 0x17, get_time_date(time(0)));
+            put32(ofcb + 0x17, get_time_date(replay_time()));
             put32(ofcb + 0x1D, 0);
         }
         if(exfcb)
@@ -752,8 +941,8 @@ static void dos_find_first_fcb(void)
 static void intr21_57(void)
 {
     unsigned al = cpuGetAX() & 0xFF;
-    FILE *f = handles[cpuGetBX()];
-    if(!f)
+    struct dos_file *d = get_handle(cpuGetBX());
+    if(!d)
     {
         cpuSetFlag(cpuFlag_CF);
         dos_error = 6;
@@ -764,7 +953,7 @@ static void intr21_57(void)
     {
         // GET FILE LAST WRITTEN TIME
         struct stat st;
-        if(0 != fstat(fileno(f), &st))
+        if(0 != fstat(file_fd(d), &st))
         {
             cpuSetFlag(cpuFlag_CF);
             dos_error = 1;
@@ -808,7 +997,7 @@ static void dos_get_drive_info(uint8_t drive)
 // Writes a character to standard output.
 static void dos_putchar(uint8_t ch, int fd)
 {
-    if(devinfo[fd] == 0x80D3 && video_active())
+    if(handle_devinfo(fd) == 0x80D3 && video_active())
     {
         // Handle TAB character here:
         if(ch == 0x09)
@@ -820,15 +1009,15 @@ static void dos_putchar(uint8_t ch, int fd)
         else
             video_putch(ch);
     }
-    else if(!handles[fd])
+    else if(!get_handle(fd))
         putchar(ch);
-    else if(!fd && devinfo[0] == 0x80D3 && devinfo[1] == 0x80D3)
+    else if(!fd && handle_devinfo(0) == 0x80D3 && handle_devinfo(1) == 0x80D3)
         // DOS programs can write to STDIN and expect output to the terminal.
         // This hack will only work if STDOUT is not redirected, in real DOS
         // you can redirect STDOUT and write to STDIN.
-        fputc(ch, handles[1]);
+        file_write(get_handle(1), &ch, 1);
     else
-        fputc(ch, handles[fd]);
+        file_write(get_handle(fd), &ch, 1);
 }
 
 static void intr21_9(void)
@@ -846,6 +1035,7 @@ static unsigned return_code;
 // Runs the emulator again with given parameters
 static int run_emulator(char *file, const char *prgname, char *cmdline, char *env)
 {
+    sync_files(0);
     pid_t pid = fork();
     if(pid == -1)
         print_error("fork error, %s\n", strerror(errno));
@@ -857,6 +1047,7 @@ static int run_emulator(char *file, const char *prgname, char *cmdline, char *en
             if(errno != EINTR)
                 print_error("error waiting child, %s\n", strerror(errno));
         }
+        sync_files(1);
         return_code = (WEXITSTATUS(status) & 0xFF);
         if(!WIFEXITED(status))
             return_code |= 0x100;
@@ -868,6 +1059,9 @@ static int run_emulator(char *file, const char *prgname, char *cmdline, char *en
     {
         // Set program name
         setenv(ENV_PROGNAME, prgname, 1);
+        // record or replay to a new file
+        replay_child_env();
+        shm_child_env();
         // default drive
         char drv[2] = {0, 0};
         drv[0] = dos_get_default_drive() + 'A';
@@ -876,9 +1070,9 @@ static int run_emulator(char *file, const char *prgname, char *cmdline, char *en
         setenv(ENV_CWD, (const char *)dos_get_cwd(0), 1);
         // pass open file descriptors to child process
         for(unsigned i = 0; i < 3; i++)
-            if(handles[i])
+            if(get_handle(i))
             {
-                int f1 = fileno(handles[i]);
+                int f1 = file_fd(get_handle(i));
                 int f2 = (f1 < 3) ? dup(f1) : f1;
                 if(f2 < 0)
                     f2 = f1;
@@ -925,12 +1119,14 @@ NORETURN void intr20(void)
 static uint16_t inp_last_key;
 static void char_input(int brk)
 {
-    fflush(handles[1] ? handles[1] : stdout);
+    struct dos_file *out = get_handle(1);
+    if(!out || out->f)
+        fflush(out ? out->f : stdout);
 
     if(inp_last_key == 0)
     {
-        if(devinfo[0] != 0x80D3 && handles[0])
-            inp_last_key = getc(handles[0]);
+        if(handle_devinfo(0) != 0x80D3 && get_handle(0))
+            inp_last_key = file_getc(get_handle(0));
         else
             inp_last_key = getch(brk);
     }
@@ -1288,22 +1484,28 @@ void intr21(void)
 
         // If we are reading from console, suspend keyboard handling and update
         // emulator state.
-        if(devinfo[0] == 0x80D3)
+        if(handle_devinfo(0) == 0x80D3)
         {
             suspend_keyboard();
             emulator_update();
         }
 
-        FILE *f = handles[0] ? handles[0] : stdin;
+        struct dos_file *d = get_handle(0);
         unsigned i;
         for(i = 0; i < len;)
         {
-            int c = getc(f);
-            // Retry if we were interrupted
-            if(c == EOF && errno == EINTR)
+            long long c;
+            if(handle_devinfo(0) != 0x80D3 || !replay_input(rr_line, &c))
             {
-                errno = 0;
-                continue;
+                c = d ? file_getc(d) : getc(stdin);
+                // Retry if we were interrupted
+                if(c == EOF && errno == EINTR)
+                {
+                    errno = 0;
+                    continue;
+                }
+                if(handle_devinfo(0) == 0x80D3)
+                    record_input(rr_line, c);
             }
             if(c == '\n' || c == EOF)
                 c = '\r';
@@ -1316,7 +1518,7 @@ void intr21(void)
         break;
     }
     case 0xB: // STDIN STATUS
-        if(devinfo[0] == 0x80D3)
+        if(handle_devinfo(0) == 0x80D3)
             cpuSetAX(char_pending() ? 0x0BFF : 0x0B00);
         else
             cpuSetAX(0x0B00);
@@ -1608,7 +1810,7 @@ void intr21(void)
     }
     case 0x2A: // GET SYSTEM DATE
     {
-        time_t tm = time(0);
+        time_t tm = replay_time();
         struct tm lt;
         if(localtime_r(&tm, &lt))
         {
@@ -1706,8 +1908,8 @@ void intr21(void)
         break;
     case 0x3F: // READ
     {
-        FILE *f = handles[cpuGetBX()];
-        if(!f)
+        struct dos_file *d = get_handle(cpuGetBX());
+        if(!d)
         {
             cpuSetFlag(cpuFlag_CF);
             dos_error = 6; // invalid handle
@@ -1724,14 +1926,15 @@ void intr21(void)
             break;
         }
         // If read from "CON", reads up to the first "CR":
-        if(devinfo[cpuGetBX()] == 0x80D3)
+        if(handle_devinfo(cpuGetBX()) == 0x80D3)
         {
             suspend_keyboard();
-            cpuSetAX(line_input(f, buf, cpuGetCX()));
+            cpuSetAX(line_input(d->f, buf, cpuGetCX()));
         }
         else
         {
-            unsigned n = fread(buf, 1, cpuGetCX(), f);
+            unsigned n = file_read(d, buf, cpuGetCX());
+            mark_dirty_range(cpuGetAddrDS(cpuGetDX()), n);
             cpuSetAX(n);
         }
         dos_error = 0;
@@ -1741,8 +1944,8 @@ void intr21(void)
     case 0x40: // WRITE
     {
         int fd = cpuGetBX();
-        FILE *f = handles[fd];
-        if(!f)
+        struct dos_file *d = get_handle(fd);
+        if(!d)
         {
             cpuSetFlag(cpuFlag_CF);
             dos_error = 6; // invalid handle
@@ -1757,23 +1960,12 @@ void intr21(void)
             dos_error = 0;
             cpuSetAX(0);
             // flush output
-            int e = fflush(f);
-            if(e)
+            if(file_truncate(d))
             {
                 cpuSetFlag(cpuFlag_CF);
                 dos_error = 5; // access denied
                 cpuSetAX(dos_error);
             }
-            else if(devinfo[fd] != 0x80D3)
-            {
-                off_t pos = ftello(f);
-                if(pos != -1 && -1 == ftruncate(fileno(f), pos))
-                {
-                    cpuSetFlag(cpuFlag_CF);
-                    dos_error = 5; // access denied
-                    cpuSetAX(dos_error);
-                }
-            }
             break;
         }
         uint8_t *buf = getptr(cpuGetAddrDS(cpuGetDX()), len);
@@ -1785,7 +1977,7 @@ void intr21(void)
             cpuSetFlag(cpuFlag_CF);
             break;
         }
-        if(devinfo[fd] == 0x80D3)
+        if(handle_devinfo(fd) == 0x80D3)
         {
             for(unsigned i = 0; i < len; i++)
                 dos_putchar(buf[i], fd);
@@ -1793,7 +1985,7 @@ void intr21(void)
         }
         else
         {
-            unsigned n = fwrite(buf, 1, len, f);
+            unsigned n = file_write(d, buf, len);
             cpuSetAX(n);
         }
         dos_error = 0;
@@ -1834,7 +2026,7 @@ void intr21(void)
     }
     case 0x42: // LSEEK
     {
-        FILE *f = handles[cpuGetBX()];
+        struct dos_file *d = get_handle(cpuGetBX());
         long pos = cpuGetDX();
         if(cpuGetCX() >= 0x8000)
             pos = pos + (((long)cpuGetCX() - 0x10000) << 16);
@@ -1842,7 +2034,7 @@ void intr21(void)
             pos = pos + (cpuGetCX() << 16);
 
         debug(debug_dos, "\tlseek-%02x pos = %ld\n", ax & 0xFF, pos);
-        if(!f)
+        if(!d)
         {
             cpuSetFlag(cpuFlag_CF);
             dos_error = 6; // invalid handle
@@ -1851,16 +2043,15 @@ void intr21(void)
         }
         switch(ax & 0xFF)
         {
-        case 0: fseek(f, pos, SEEK_SET); break;
-        case 1: fseek(f, pos, SEEK_CUR); break;
-        case 2: fseek(f, pos, SEEK_END); break;
+        case 0: pos = file_seek(d, pos, SEEK_SET); break;
+        case 1: pos = file_seek(d, pos, SEEK_CUR); break;
+        case 2: pos = file_seek(d, pos, SEEK_END); break;
         default:
             cpuSetFlag(cpuFlag_CF);
             dos_error = 1;
             cpuSetAX(dos_error);
             return;
         }
-        pos = ftell(f);
         cpuSetAX(pos & 0xFFFF);
         cpuSetDX((pos >> 16) & 0xFFFF);
         dos_error = 0;
@@ -1875,7 +2066,7 @@ void intr21(void)
         int h = cpuGetBX();
         int al = ax & 0xFF;
         if((al < 4 || al == 6 || al == 7 || al == 10 || al == 12 || al == 16) &&
-           !handles[h])
+           !get_handle(h))
         {
             // Show error if it is a file handle.
             debug(debug_dos, "\t(invalid file handle)\n");
@@ -1889,10 +2080,10 @@ void intr21(void)
         switch(al)
         {
         case 0x00: // GET DEV INFO
-            debug(debug_dos, "\t= %04x\n", devinfo[h]);
-            cpuSetDX(devinfo[h]);
+            debug(debug_dos, "\t= %04x\n", handle_devinfo(h));
+            cpuSetDX(handle_devinfo(h));
             // Undocumented, needed for VEDIT INSTALL
-            cpuSetAX(devinfo[h]);
+            cpuSetAX(handle_devinfo(h));
             break;
         case 0x01: // SET DEV INFO
         case 0x02: // IOCTL CHAR DEV READ
@@ -1904,10 +2095,10 @@ void intr21(void)
             cpuSetFlag(cpuFlag_CF);
             break;
         case 0x06: // GET INPUT STATUS
-            if(devinfo[h] == 0x80D3)
+            if(handle_devinfo(h) == 0x80D3)
                 cpuSetAX(char_pending() ? 0x44FF : 0x4400);
             else
-                cpuSetAX(feof(handles[h]) ? 0x4400 : 0x44FF);
+                cpuSetAX(file_eof(get_handle(h)) ? 0x4400 : 0x44FF);
             break;
         case 0x07: // GET OUTPUT STATUS
             cpuSetAX(0x44FF);
@@ -1943,7 +2134,7 @@ void intr21(void)
     }
     case 0x45:
     {
-        if(!handles[cpuGetBX()])
+        if(!get_handle(cpuGetBX()))
         {
             // Show error if it is a file handle.
             debug(debug_dos, "\t(invalid file handle)\n");
@@ -1961,8 +2152,7 @@ void intr21(void)
             break;
         }
         debug(debug_dos, "\t%04x -> %04x\n", cpuGetBX(), (unsigned)h);
-        handles[h] = handles[cpuGetBX()];
-        devinfo[h] = devinfo[cpuGetBX()];
+        dup_handle(h, cpuGetBX());
         cpuSetAX(h);
         dos_error = 0;
         cpuClrFlag(cpuFlag_CF);
@@ -1970,7 +2160,7 @@ void intr21(void)
     }
     case 0x46:
     {
-        if(!handles[cpuGetBX()])
+        if(!get_handle(cpuGetBX()))
         {
             // Show error if it is a file handle.
             debug(debug_dos, "\t(invalid file handle)\n");
@@ -1979,10 +2169,12 @@ void intr21(void)
             cpuSetFlag(cpuFlag_CF);
             break;
         }
-        if(handles[cpuGetCX()])
-            dos_close_file(cpuGetCX());
-        handles[cpuGetCX()] = handles[cpuGetBX()];
-        devinfo[cpuGetCX()] = devinfo[cpuGetBX()];
+        if(cpuGetCX() != cpuGetBX())
+        {
+            if(get_handle(cpuGetCX()))
+                dos_close_file(cpuGetCX());
+            dup_handle(cpuGetCX(), cpuGetBX());
+        }
         cpuClrFlag(cpuFlag_CF);
         break;
     }
@@ -2353,6 +2545,8 @@ void intr21(void)
         cpuClrFlag(cpuFlag_CF);
         break;
     case 0x67: // SET HANDLE COUNT
+        if(cpuGetBX())
+            grow_jft(cpuGetBX() - 1);
         cpuClrFlag(cpuFlag_CF);
         break;
     case 0x6C: // EXTENDED OPEN/CREATE FILE
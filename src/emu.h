@@ -29,6 +29,15 @@ void emulator_update(void);
 // Sleeps keeping track of CPU speed
 void cpu_usleep(int us);
 
+// As above, but calls "wait" to sleep, that can return before "us" microseconds
+void cpu_wait(int us, void (*wait)(int us));
+
+// Returns the number of instructions executed
+uint64_t cpu_get_ins_count(void);
+
+// Makes execute() return when the instruction count reaches "count"
+void cpu_set_stop_count(uint64_t count);
+
 // Trigger hardware interrupts.
 // IRQ-0 to IRQ-7 call INT-08 to INT-0F
 // IRQ-8 to IRQ-F call INT-70 to INT-77
@@ -85,12 +94,41 @@ void cpuClrFlag(enum cpuFlags flag);
 void cpuSetStartupFlag(enum cpuFlags flag);
 void cpuClrStartupFlag(enum cpuFlags flag);
 
+// Flags of modified text video memory at B8000-BFFFF, one for each 32 bytes,
+// with a bit for the screen update and one for the screen text search.
+#define VIDEO_DIRTY_SHIFT 5
+#define VIDEO_DIRTY_SCREEN 1
+#define VIDEO_DIRTY_TEXT 2
+#define VIDEO_DIRTY_ALL (VIDEO_DIRTY_SCREEN | VIDEO_DIRTY_TEXT)
+extern uint8_t video_dirty[0x8000 >> VIDEO_DIRTY_SHIFT];
+
+// Marks a write to memory, to update the screen if it is in video memory.
+static inline void mark_dirty(uint32_t addr)
+{
+    if(addr - 0xB8000 < 0x8000)
+        video_dirty[(addr - 0xB8000) >> VIDEO_DIRTY_SHIFT] = VIDEO_DIRTY_ALL;
+}
+
+// Marks a write to a block of memory.
+static inline void mark_dirty_range(uint32_t addr, unsigned size)
+{
+    if(size && addr < 0xC0000 && addr + size > 0xB8000)
+    {
+        uint32_t start = addr < 0xB8000 ? 0 : addr - 0xB8000;
+        uint32_t end = addr + size > 0xC0000 ? 0x8000 : addr + size - 0xB8000;
+        memset(video_dirty + (start >> VIDEO_DIRTY_SHIFT), VIDEO_DIRTY_ALL,
+               ((end - 1) >> VIDEO_DIRTY_SHIFT) - (start >> VIDEO_DIRTY_SHIFT) + 1);
+    }
+}
+
 // Helper functions to access memory
 // Read 16 bit number
 static inline void put16(int addr, int v)
 {
     memory[0xFFFFF & (addr)] = v;
     memory[0xFFFFF & (addr + 1)] = v >> 8;
+    mark_dirty(0xFFFFF & addr);
+    mark_dirty(0xFFFFF & (addr + 1));
 }
 
 // Read 32 bit number
@@ -133,6 +171,7 @@ static inline int putmem(uint32_t dest, const uint8_t *src, unsigned size)
     if(size >= 0x100000 || dest >= 0x100000 || size + dest >= 0x100000)
         return 1;
     memcpy(memory + dest, src, size);
+    mark_dirty_range(dest, size);
     return 0;
 }
 
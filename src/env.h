@@ -13,3 +13,16 @@
 #define ENV_ROWS      "EMU2_ROWS"
 #define ENV_DOSVER    "EMU2_DOSVER"
 #define ENV_CPUSPEED  "EMU2_CPU_SPEED"
+#define ENV_CPUMHZ    "EMU2_CPU_MHZ"
+#define ENV_CPUMODEL  "EMU2_CPU_MODEL"
+#define ENV_RECORD    "EMU2_RECORD"
+#define ENV_REPLAY    "EMU2_REPLAY"
+#define ENV_TERMSYNC  "EMU2_TERM_SYNC"
+#define ENV_FPS       "EMU2_FPS"
+#define ENV_HEADLESS  "EMU2_HEADLESS"
+#define ENV_DUMP      "EMU2_SCREEN_DUMP"
+#define ENV_DUMP_ANSI "EMU2_DUMP_ANSI"
+#define ENV_KEYB_FILE "EMU2_KEYB_FILE"
+#define ENV_CAST      "EMU2_RECORD_CAST"
+#define ENV_SHM       "EMU2_SHM"
+#define ENV_KEYS      "EMU2_KEYS"
@@ -2,25 +2,64 @@
 #include "codepage.h"
 #include "dbg.h"
 #include "emu.h"
+#include "env.h"
 #include "os.h"
+#include "replay.h"
+#include "video.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_KEYB_CALLS 10
+// Time without throttling after the last key of a paste, in microseconds
+#define PASTE_TIME 50000
 
 static int term_raw = 0;
 static int tty_fd = -1;
+// Keys are read from a file or pipe instead of the terminal
+static int keyb_file, keyb_eof;
 static int queued_key = -1;
 static int waiting_key = 0;
 static int mod_state = 0;
 static int throttle_calls = 0;
+// Set if more keys were waiting when the queued key was read
+static int key_more = 0;
+
+// The terminal is read and decoded in the input thread, that adds the keys
+// to the ring; the emulator takes them with no system calls. Each key is
+// stored with the modifier state in the high bits. The ring is written only
+// by the input thread and read only by the emulator, "head" and "tail" are
+// accessed with atomic loads and stores. The ring is big enough to hold a
+// paste of a few pages of text, so the terminal is read at full speed.
+#define KEY_RING_SIZE 16384
+// Flag added to a key when more keys are waiting in the ring, as in a paste
+#define KEY_MORE (1 << 24)
+static struct
+{
+    uint32_t keys[KEY_RING_SIZE];
+    unsigned head, tail;
+} key_ring;
+// The lock and condition are used to wait for keys and to pause the thread
+// while the terminal is not in raw mode.
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t key_cond = PTHREAD_COND_INITIALIZER;
+static int input_running, input_pause, input_paused;
+// Pipe used to wake up the input thread
+static int wake_fd[2] = {-1, -1};
+// Modifier state of the key being decoded by the input thread
+static int key_mod;
+// Data read from the terminal, not yet decoded
+static char in_buf[256];
+static unsigned in_pos, in_len;
 
 // Copy mod-state to BIOS memory area
 static void update_bios_state(void)
@@ -36,6 +75,24 @@ static void keyb_read_buffer(void)
     memory[0x41A] = 0x1E + ((ptr + 2) & 0x1F);
 }
 
+// Returns the next byte of input if already available, without waiting.
+static int in_byte(char *ch)
+{
+    if(in_pos == in_len)
+    {
+        struct pollfd pf = {tty_fd, POLLIN, 0};
+        if(poll(&pf, 1, 0) != 1 || !(pf.revents & POLLIN))
+            return 0;
+        ssize_t n = read(tty_fd, in_buf, sizeof(in_buf));
+        if(n <= 0)
+            return 0;
+        in_pos = 0;
+        in_len = n;
+    }
+    *ch = in_buf[in_pos++];
+    return 1;
+}
+
 // Table of scan codes for keys + modifiers:
 static uint8_t special_codes[23][4] = {
     {0x3B, 0x54, 0x5E, 0x68}, // F1
@@ -91,9 +148,9 @@ enum mod_keys
 
 static int get_special_code(int key)
 {
-    if(mod_state & MOD_ALT)        return special_codes[key][3] << 8;
-    else if(mod_state & MOD_CTRL)  return special_codes[key][2] << 8;
-    else if(mod_state & MOD_SHIFT) return special_codes[key][1] << 8;
+    if(key_mod & MOD_ALT)        return special_codes[key][3] << 8;
+    else if(key_mod & MOD_CTRL)  return special_codes[key][2] << 8;
+    else if(key_mod & MOD_SHIFT) return special_codes[key][1] << 8;
     else                           return special_codes[key][0] << 8;
 }
 
@@ -194,7 +251,7 @@ static int add_scancode(int i)
     if(i < 0x20 && i != 0x1B && i != 0x0D && i != 0x09)
     {
         // CTRL+KEY
-        mod_state |= MOD_CTRL;
+        key_mod |= MOD_CTRL;
         int orig = i;
         if(i == 0x1C)      i = '\\';
         else if(i == 0x1D) i = ']';
@@ -208,7 +265,7 @@ static int add_scancode(int i)
     else if((i > 0x20 && i < 0x27) || (i > 0x27 && i < 0x2C) || (i == 0x3A) ||
             (i == 0x3C) || (i > 0x3D && i < 0x5B) || (i > 0x5D && i < 0x60) ||
             (i > 0x7A && i < 0x7F))
-        mod_state |= MOD_SHIFT;
+        key_mod |= MOD_SHIFT;
     // Fixes BackSpace
     if(i == 0x7F)
         i = 0x08;
@@ -221,7 +278,7 @@ static int add_scancode(int i)
 // Convert key-code with ALT to scan-code
 static int alt_char(int i)
 {
-    mod_state = MOD_ALT;
+    key_mod = MOD_ALT;
     return add_scancode(i) & 0xFF00; // No ASCII code on ALT+char
 }
 
@@ -232,9 +289,9 @@ static int get_esc_sequence(void)
     // ESC <letter>                     ALT+letter
     // ESC <number>                     ALT+number
     // ESC [ <modifiers> <letter>       Function Keys
-    mod_state = 0;
+    key_mod = 0;
     char ch = '\xFF';
-    if(read(tty_fd, &ch, 1) == 0)
+    if(!in_byte(&ch))
         return 0x011B; // ESC
     if(ch != '[' && ch != 'O')
         return alt_char(ch);
@@ -243,7 +300,7 @@ static int get_esc_sequence(void)
     while(1)
     {
         char cn = '\xFF';
-        if(read(tty_fd, &cn, 1) == 0)
+        if(!in_byte(&cn))
         {
             if(n1 == 0 && n2 == 0)
                 return alt_char(ch); // it is an ALT+'[' or ALT+'O'
@@ -266,9 +323,9 @@ static int get_esc_sequence(void)
                 n2 = 1;
             }
             n2--;
-            if(n2 & 1) mod_state |= MOD_SHIFT;
-            if(n2 & 2) mod_state |= MOD_ALT;
-            if(n2 & 4) mod_state |= MOD_CTRL;
+            if(n2 & 1) key_mod |= MOD_SHIFT;
+            if(n2 & 2) key_mod |= MOD_ALT;
+            if(n2 & 4) key_mod |= MOD_CTRL;
             switch(n1)
             {
             case 1:  return get_special_code(KEY_HOME); // old xterm
@@ -296,9 +353,9 @@ static int get_esc_sequence(void)
         {
             if(n2)
                 n2--;
-            if(n2 & 1) mod_state |= MOD_SHIFT;
-            if(n2 & 2) mod_state |= MOD_ALT;
-            if(n2 & 4) mod_state |= MOD_CTRL;
+            if(n2 & 1) key_mod |= MOD_SHIFT;
+            if(n2 & 2) key_mod |= MOD_ALT;
+            if(n2 & 4) key_mod |= MOD_CTRL;
             switch(cn)
             {
             case 'A': return get_special_code(KEY_UP);
@@ -313,7 +370,7 @@ static int get_esc_sequence(void)
             case 'Q': return get_special_code(KEY_FN(2)); // F2
             case 'R': return get_special_code(KEY_FN(3)); // F3
             case 'S': return get_special_code(KEY_FN(4)); // F4
-            case 'Z': mod_state |= MOD_SHIFT; return 0x0F00; // shift-TAB
+            case 'Z': key_mod |= MOD_SHIFT; return 0x0F00; // shift-TAB
             default:  return 0; // ERROR!
             }
         }
@@ -324,46 +381,424 @@ static int read_key(void)
 {
     char ch = '\xFF';
     // Reads first key code
-    if(read(tty_fd, &ch, 1) == 0)
+    if(!in_byte(&ch))
         return -1; // No data
 
     // ESC + keys, terminal codes
     if(ch == 0x1B)
         return get_esc_sequence();
 
-    mod_state = 0;
+    key_mod = 0;
     // Normal key
     if((ch & 0xFF) < 0x80)
         return add_scancode(ch);
 
     // Unicode character, read rest of codes
-    if((ch & 0xE0) == 0xC0)
+    char seq[4] = {ch};
+    unsigned len = (ch & 0xE0) == 0xC0   ? 2
+                   : (ch & 0xF0) == 0xE0 ? 3
+                   : (ch & 0xF8) == 0xF0 ? 4
+                                         : 0;
+    if(!len)
+        return 0; // INVALID UTF-8
+    for(unsigned i = 1; i < len; i++)
+        if(!in_byte(seq + i) || (seq[i] & 0xC0) != 0x80)
+            return -1; // INVALID UTF-8
+    uint8_t dos_char;
+    unsigned used;
+    cp_from_utf8(&dos_char, seq, len, &used);
+    return dos_char;
+}
+
+// Keys from the script file, given to the program when it waits for a key.
+// Entries with SCRIPT_WAIT set are the index of a text to wait for in the
+// screen before continuing.
+#define SCRIPT_WAIT 0x80000000
+static uint32_t *script_keys;
+static unsigned script_len, script_pos;
+static struct screen_text *script_waits;
+static unsigned script_num_waits;
+// The current wait was already checked, only changes are searched
+static int script_waiting;
+
+// Named keys in the script, as <name>
+static const struct
+{
+    const char *name;
+    int special; // Index in the special_codes table, or -1
+    int key;     // Key code if not special
+} script_names[] = {
+    {"enter", -1, 0x0D},      {"esc", -1, 0x1B},        {"tab", -1, 0x09},
+    {"bs", -1, 0x7F},         {"space", -1, ' '},       {"lt", -1, '<'},
+    {"up", KEY_UP, 0},        {"down", KEY_DOWN, 0},    {"left", KEY_LEFT, 0},
+    {"right", KEY_RIGHT, 0},  {"pgup", KEY_PGUP, 0},    {"pgdn", KEY_PGDN, 0},
+    {"home", KEY_HOME, 0},    {"end", KEY_END, 0},      {"ins", KEY_INS, 0},
+    {"del", KEY_DEL, 0},      {"f1", KEY_FN(1), 0},     {"f2", KEY_FN(2), 0},
+    {"f3", KEY_FN(3), 0},     {"f4", KEY_FN(4), 0},     {"f5", KEY_FN(5), 0},
+    {"f6", KEY_FN(6), 0},     {"f7", KEY_FN(7), 0},     {"f8", KEY_FN(8), 0},
+    {"f9", KEY_FN(9), 0},     {"f10", KEY_FN(10), 0},   {"f11", KEY_FN(11), 0},
+    {"f12", KEY_FN(12), 0},   {0, 0, 0},
+};
+
+// Returns the key code of a key given by name, with optional modifiers as
+// "C-", "A-" and "S-" prefixes, or -1 if not valid.
+static int script_key_name(const char *name)
+{
+    key_mod = 0;
+    for(; name[0] && name[1] == '-'; name += 2)
     {
-        char ch1 = '\xFF';
-        if(read(tty_fd, &ch1, 1) == 0 || (ch1 & 0xC0) != 0x80)
-            return 0; // INVALID UTF-8
-        return get_dos_char(((ch & 0x1F) << 6) | (ch1 & 0x3F));
+        if(name[0] == 'C' || name[0] == 'c')
+            key_mod |= MOD_CTRL;
+        else if(name[0] == 'A' || name[0] == 'a')
+            key_mod |= MOD_ALT;
+        else if(name[0] == 'S' || name[0] == 's')
+            key_mod |= MOD_SHIFT;
+        else
+            return -1;
     }
-    else if((ch & 0xF0) == 0xE0)
+    int mod = key_mod;
+    if(name[0] && !name[1])
     {
-        char ch1 = '\xFF', ch2 = '\xFF';
-        if(read(tty_fd, &ch1, 1) == 0 || (ch1 & 0xC0) != 0x80 ||
-           read(tty_fd, &ch2, 1) == 0 || (ch2 & 0xC0) != 0x80)
-            return -1; // INVALID UTF-8
-        return get_dos_char(((ch & 0x0F) << 12) | ((ch1 & 0x3F) << 6) | (ch2 & 0x3F));
+        // Single character with modifiers
+        if(mod & MOD_ALT)
+            return alt_char(name[0]);
+        else if(mod & MOD_CTRL)
+            return add_scancode(name[0] & 0x1F);
+        key_mod = 0;
+        return add_scancode(name[0]);
     }
-    else if((ch & 0xF8) == 0xF0)
+    for(int i = 0; script_names[i].name; i++)
     {
-        char ch1 = '\xFF', ch2 = '\xFF', ch3 = '\xFF';
-        if(read(tty_fd, &ch1, 1) == 0 || (ch1 & 0xC0) != 0x80 ||
-           read(tty_fd, &ch2, 1) == 0 || (ch2 & 0xC0) != 0x80 ||
-           read(tty_fd, &ch3, 1) == 0 || (ch3 & 0xC0) != 0x80)
-            return -1; // INVALID UTF-8
-        return get_dos_char(((ch & 0x07) << 18) | ((ch1 & 0x3F) << 12) |
-                            ((ch2 & 0x3F) << 6) | (ch3 & 0x3F));
+        if(strcasecmp(name, script_names[i].name))
+            continue;
+        if(script_names[i].special >= 0)
+            return get_special_code(script_names[i].special);
+        key_mod = 0;
+        int key = add_scancode(script_names[i].key);
+        key_mod |= mod;
+        return (mod & MOD_ALT) ? key & 0xFF00 : key;
     }
-    else
-        return 0; // INVALID UTF-8
+    return -1;
+}
+
+// Parses a wait for text in the script, as "wait:text" or "regex:expr", with
+// an optional position as "wait@row,col:text". Returns 0 if not valid.
+static int script_wait(const char *spec, struct screen_text *t)
+{
+    t->regex = !strncasecmp(spec, "regex", 5);
+    if(!t->regex && strncasecmp(spec, "wait", 4))
+        return 0;
+    spec += t->regex ? 5 : 4;
+    t->row = t->col = -1;
+    if(*spec == '@')
+    {
+        char *ep;
+        t->row = strtol(spec + 1, &ep, 10);
+        // Only the first 64 rows and 256 columns are searched
+        if(ep == spec + 1 || t->row < 0 || t->row >= 64)
+            return 0;
+        if(*ep == ',')
+        {
+            spec = ep + 1;
+            t->col = strtol(spec, &ep, 10);
+            if(ep == spec || t->col < 0 || t->col >= 256)
+                return 0;
+        }
+        spec = ep;
+    }
+    if(*spec != ':')
+        return 0;
+    spec++;
+    // Convert to DOS characters, as in the screen
+    unsigned len = strlen(spec), used;
+    t->text = malloc(len + 1);
+    if(!t->text)
+        print_error("out of memory reading key script.\n");
+    t->text[cp_from_utf8((uint8_t *)t->text, spec, len, &used)] = 0;
+    return video_text_init(t);
+}
+
+// Reads the key script: the text is typed as is, with each line end as an
+// ENTER key; other keys are given as <name>.
+static void load_key_script(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if(!f)
+        print_error("can't open key script '%s': %s\n", fname, strerror(errno));
+    unsigned max = 0, line = 1;
+    int c;
+    while((c = getc(f)) != EOF)
+    {
+        int key;
+        if(script_len == max)
+        {
+            max = max ? max * 2 : 256;
+            script_keys = realloc(script_keys, max * sizeof(*script_keys));
+            if(!script_keys)
+                print_error("out of memory reading key script.\n");
+        }
+        if(c == '\r')
+            continue;
+        else if(c == '\n')
+        {
+            key_mod = 0;
+            key = add_scancode(0x0D);
+            line++;
+        }
+        else if(c == '<')
+        {
+            // Read up to the '>', written as "\>" inside
+            char name[1024];
+            unsigned l = 0;
+            while((c = getc(f)) != EOF && c != '>' && c != '\n' && l < sizeof(name) - 1)
+            {
+                if(c == '\\' && (c = getc(f)) != '>')
+                {
+                    ungetc(c, f);
+                    c = '\\';
+                }
+                name[l++] = c;
+            }
+            name[l] = 0;
+            key = c == '>' ? script_key_name(name) : -1;
+            if(key == -1 && c == '>')
+            {
+                // Add a wait for text in the screen
+                script_waits = realloc(script_waits,
+                                       (script_num_waits + 1) * sizeof(*script_waits));
+                if(!script_waits)
+                    print_error("out of memory reading key script.\n");
+                if(script_wait(name, &script_waits[script_num_waits]))
+                {
+                    script_keys[script_len++] = SCRIPT_WAIT | script_num_waits++;
+                    continue;
+                }
+            }
+            if(key == -1)
+                print_error("key script '%s', line %u: invalid key '<%s'.\n", fname, line,
+                            name);
+        }
+        else if(c < 0x80)
+        {
+            key_mod = 0;
+            key = add_scancode(c);
+        }
+        else
+        {
+            // UTF-8 sequence, converted to the DOS character
+            char seq[4] = {c};
+            unsigned l = 1, used, n;
+            uint8_t dos_char;
+            while(!(n = cp_from_utf8(&dos_char, seq, l, &used)) && !used && l < 4 &&
+                  (c = getc(f)) != EOF)
+                seq[l++] = c;
+            if(!n)
+                continue; // INVALID UTF-8
+            key_mod = 0;
+            key = dos_char;
+        }
+        script_keys[script_len++] = key | (key_mod << 16);
+    }
+    fclose(f);
+}
+
+// Returns the next key from the script, or -1 if there are no more keys or
+// the text to wait for is not yet in the screen.
+static long long script_next(void)
+{
+    while(script_pos < script_len && (script_keys[script_pos] & SCRIPT_WAIT))
+    {
+        struct screen_text *t = &script_waits[script_keys[script_pos] & ~SCRIPT_WAIT];
+        if(!video_find_text(t, !script_waiting))
+        {
+            script_waiting = 1;
+            return -1;
+        }
+        script_waiting = 0;
+        script_pos++;
+    }
+    if(script_pos == script_len)
+        return -1;
+    return script_keys[script_pos++];
+}
+
+static int ring_empty(void)
+{
+    return __atomic_load_n(&key_ring.head, __ATOMIC_ACQUIRE) == key_ring.tail;
+}
+
+// Waits while the input thread is paused. Called from the input thread.
+static void check_pause(void)
+{
+    pthread_mutex_lock(&key_lock);
+    if(input_pause)
+    {
+        input_paused = 1;
+        pthread_cond_broadcast(&key_cond);
+        while(input_pause)
+            pthread_cond_wait(&key_cond, &key_lock);
+        input_paused = 0;
+    }
+    pthread_mutex_unlock(&key_lock);
+}
+
+// Adds a key to the ring, waiting if it is full. Called from the input thread.
+static void ring_push(uint32_t key)
+{
+    unsigned head = key_ring.head;
+    while(head - __atomic_load_n(&key_ring.tail, __ATOMIC_ACQUIRE) >= KEY_RING_SIZE)
+    {
+        check_pause();
+        pthread_mutex_lock(&key_lock);
+        while(!input_pause &&
+              head - __atomic_load_n(&key_ring.tail, __ATOMIC_ACQUIRE) >= KEY_RING_SIZE)
+            pthread_cond_wait(&key_cond, &key_lock);
+        pthread_mutex_unlock(&key_lock);
+    }
+    key_ring.keys[head % KEY_RING_SIZE] = key;
+    __atomic_store_n(&key_ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Takes a key from the ring, returns -1 if empty. Called from the emulator.
+static long long ring_pop(void)
+{
+    unsigned tail = key_ring.tail;
+    if(__atomic_load_n(&key_ring.head, __ATOMIC_ACQUIRE) == tail)
+        return -1;
+    uint32_t key = key_ring.keys[tail % KEY_RING_SIZE];
+    __atomic_store_n(&key_ring.tail, tail + 1, __ATOMIC_RELEASE);
+    unsigned used = __atomic_load_n(&key_ring.head, __ATOMIC_ACQUIRE) - tail;
+    // Wake the input thread if it is waiting for space in the ring
+    if(used >= KEY_RING_SIZE)
+    {
+        pthread_mutex_lock(&key_lock);
+        pthread_cond_broadcast(&key_cond);
+        pthread_mutex_unlock(&key_lock);
+    }
+    return used > 1 ? key | KEY_MORE : key;
+}
+
+// Reads the terminal and adds the decoded keys to the ring.
+static void *input_thread(void *arg)
+{
+    while(1)
+    {
+        check_pause();
+        struct pollfd pf[2] = {{tty_fd, POLLIN, 0}, {wake_fd[0], POLLIN, 0}};
+        if(poll(pf, 2, -1) < 0)
+            continue;
+        // Woken up to check for a pause
+        if(pf[1].revents)
+        {
+            char c;
+            while(read(wake_fd[0], &c, 1) < 0 && errno == EINTR)
+                ;
+            continue;
+        }
+        if(!pf[0].revents)
+            continue;
+        ssize_t n = read(tty_fd, in_buf, sizeof(in_buf));
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(n <= 0)
+            break; // End of file or terminal closed
+        in_pos = 0;
+        in_len = n;
+        while(in_pos < in_len)
+        {
+            int key = read_key();
+            if(key != -1)
+                ring_push(key | (key_mod << 16));
+        }
+        pthread_mutex_lock(&key_lock);
+        pthread_cond_broadcast(&key_cond);
+        pthread_mutex_unlock(&key_lock);
+    }
+    pthread_mutex_lock(&key_lock);
+    if(keyb_file)
+        __atomic_store_n(&keyb_eof, 1, __ATOMIC_RELEASE);
+    input_running = 0;
+    pthread_cond_broadcast(&key_cond);
+    pthread_mutex_unlock(&key_lock);
+    return 0;
+}
+
+// Stops the input thread from reading the terminal, waiting until it stops.
+static void pause_input(void)
+{
+    if(input_pause)
+        return;
+    pthread_mutex_lock(&key_lock);
+    input_pause = 1;
+    pthread_cond_broadcast(&key_cond);
+    if(input_running && write(wake_fd[1], "", 1) == 1)
+        while(!input_paused && input_running)
+            pthread_cond_wait(&key_cond, &key_lock);
+    pthread_mutex_unlock(&key_lock);
+}
+
+static void resume_input(void)
+{
+    pthread_mutex_lock(&key_lock);
+    input_pause = 0;
+    pthread_cond_broadcast(&key_cond);
+    pthread_mutex_unlock(&key_lock);
+}
+
+// Waits up to "us" microseconds for a key from the input thread
+static void wait_key(int us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (us % 1000000) * 1000L;
+    ts.tv_sec += us / 1000000 + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_mutex_lock(&key_lock);
+    while(ring_empty() && input_running && !input_pause)
+        if(pthread_cond_timedwait(&key_cond, &key_lock, &ts))
+            break;
+    pthread_mutex_unlock(&key_lock);
+    // Sleep the remaining time if there is no thread to wake us
+    if(!input_running || input_pause)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        long long left = (ts.tv_sec - now.tv_sec) * 1000000LL;
+        left += (ts.tv_nsec - now.tv_nsec) / 1000;
+        if(left > 0)
+            usleep(left);
+    }
+}
+
+// The forked child process runs without the input thread, the parent stops
+// reading the terminal until the keyboard is used again.
+static void fork_prepare(void)
+{
+    pause_input();
+}
+
+static void fork_child(void)
+{
+    input_running = 0;
+}
+
+static void start_input_thread(void)
+{
+    if(pipe(wake_fd))
+        print_error("error creating pipe, %s\n", strerror(errno));
+    // Start paused, until the terminal is in raw mode
+    input_pause = 1;
+    // All signals are handled by the emulator
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t id;
+    input_running = !pthread_create(&id, 0, input_thread, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if(!input_running)
+        print_error("error creating input thread.\n");
+    pthread_detach(id);
+    pthread_atfork(fork_prepare, 0, fork_child);
 }
 
 static void set_raw_term(int raw)
@@ -373,6 +808,10 @@ static void set_raw_term(int raw)
         return;
 
     term_raw = raw;
+    if(!raw)
+        pause_input();
+    if(keyb_file)
+        return;
     if(term_raw)
     {
         struct termios newattr;
@@ -405,12 +844,29 @@ static void init_keyboard(void)
 {
     if(tty_fd < 0)
     {
-        tty_fd = open("/dev/tty", O_NOCTTY | O_RDONLY);
+        // Read keys from the given file, or nothing if there is no terminal
+        const char *name = getenv(ENV_KEYB_FILE);
+        if(!name && getenv(ENV_HEADLESS) && atoi(getenv(ENV_HEADLESS)))
+            name = "/dev/null";
+        keyb_file = name != 0;
+        if(keyb_file)
+            tty_fd = open(name, O_RDONLY | O_NONBLOCK);
+        else
+            tty_fd = open("/dev/tty", O_NOCTTY | O_RDONLY);
         if(tty_fd < 0)
-            print_error("error at open TTY, %s\n", strerror(errno));
+            print_error("error at open %s, %s\n", keyb_file ? name : "TTY", strerror(errno));
         atexit(exit_keyboard);
+        // On replay, the keys are read from the replay file
+        if(!replay_active())
+        {
+            if(getenv(ENV_KEYS))
+                load_key_script(getenv(ENV_KEYS));
+            start_input_thread();
+        }
     }
     set_raw_term(1);
+    if(input_pause)
+        resume_input();
 }
 
 // Disables keyboard support - will be enabled again if needed
@@ -425,28 +881,62 @@ void keyb_wakeup(void)
     throttle_calls = 0;
 }
 
-int kbhit(void)
+// Reads a key from the terminal or from the replay file, the key is stored
+// together with the modifier state and the KEY_MORE flag. If "inject" is set,
+// the program is waiting for a key, and keys from the script are given when
+// there is no other key.
+static int get_key(int inject)
+{
+    long long key;
+    // Only the keys read are recorded, not the empty checks
+    if(replay_active())
+    {
+        if(!replay_next(rr_key, &key))
+            return -1;
+    }
+    else
+    {
+        key = ring_pop();
+        if(key == -1 && inject)
+            key = script_next();
+        if(key == -1)
+            return -1;
+        record_input(rr_key, key);
+    }
+    mod_state = (key >> 16) & 0xFF;
+    key_more = (key & KEY_MORE) != 0;
+    return key & 0xFFFF;
+}
+
+// Checks for a key, with "inject" set if the program is waiting for a key
+static int check_key(int inject)
 {
     if(queued_key == -1)
     {
         init_keyboard();
-        queued_key = read_key();
+        queued_key = get_key(inject);
+        // Used to throttle the CPU on a busy-loop waiting for keyboard, but not
+        // while keys are being pasted.
+        static double last_time, paste_time;
+        struct timeval tv;
         if(queued_key != -1)
         {
             update_bios_state();
             cpuTriggerIRQ(1);
+            video_key_pressed();
+            if(key_more && gettimeofday(&tv, NULL) != -1)
+                paste_time = tv.tv_usec + tv.tv_sec * 1000000.0;
         }
         else
         {
-            // Used to throttle the CPU on a busy-loop waiting for keyboard
-            static double last_time;
-
-            struct timeval tv;
+            video_idle();
             if(gettimeofday(&tv, NULL) != -1)
             {
                 double t1 = tv.tv_usec + tv.tv_sec * 1000000.0;
+                if((t1 - paste_time) < PASTE_TIME)
+                    throttle_calls = 0;
                 // Arbitrary limit to 4 calls each 100Hz
-                if((t1 - last_time) < 10000)
+                else if((t1 - last_time) < 10000)
                 {
                     throttle_calls++;
                     if(throttle_calls > MAX_KEYB_CALLS)
@@ -465,14 +955,25 @@ int kbhit(void)
     return (queued_key == -1) ? 0 : queued_key;
 }
 
+// Checks for a key without giving keys from the script
+int kbhit(void)
+{
+    return check_key(0);
+}
+
 int getch(int detect_brk)
 {
     int ret;
     while(queued_key == -1)
     {
-        if(kbhit())
+        if(check_key(1))
             break;
-        cpu_usleep(100000);
+        // Nothing more to read, the program would wait forever
+        if(replay_active() ? replay_ended()
+                           : __atomic_load_n(&keyb_eof, __ATOMIC_ACQUIRE) && ring_empty())
+            print_error("end of keyboard input while waiting for a key.\n");
+        video_idle();
+        cpu_wait(100000, wait_key);
         waiting_key = 1;
         emulator_update();
         waiting_key = 0;
@@ -483,6 +984,10 @@ int getch(int detect_brk)
     queued_key = -1;
     keyb_read_buffer();
     update_bios_state();
+    // Refill the BIOS buffer with the next key of a paste, so the program sees
+    // it without waiting for the next update.
+    if(key_more)
+        check_key(0);
     return ret;
 }
 
@@ -490,7 +995,7 @@ void update_keyb(void)
 {
     // See if any key is available:
     if(tty_fd >= 0 && term_raw && !waiting_key && queued_key == -1)
-        kbhit();
+        check_key(0);
 }
 
 // Keyboard controller status
@@ -587,7 +1092,7 @@ void intr16(void)
     case 1:    // GET KEY AVAILABLE
     case 0x11: // CHECK FOR ENHANCED KEY AVAILABLE
         // TODO: implement differences between 01h / 11h
-        ax = kbhit();
+        ax = check_key(1);
         cpuSetAX(ax);
         if(ax == 0)
             cpuSetFlag(cpuFlag_ZF);
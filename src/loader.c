@@ -1,13 +1,14 @@
 #include "loader.h"
 #include "dbg.h"
 #include "emu.h"
+#include "os.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Main Memory (17 * 64K, no overlap)
-uint8_t memory[0x110000];
+// Main Memory (17 * 64K, no overlap), aligned so it can be mapped to shared memory
+uint8_t memory[0x110000] PAGE_ALIGNED;
 // First MCB
 static uint16_t mcb_start = 0x40;
 // MCB allocation strategy
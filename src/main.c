@@ -1,6 +1,7 @@
 
 #define _GNU_SOURCE
 
+#include "bench.h"
 #include "dbg.h"
 #include "dos.h"
 #include "dosnames.h"
@@ -9,6 +10,8 @@
 #include "timer.h"
 #include "video.h"
 #include "os.h"
+#include "replay.h"
+#include "shm.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -56,7 +59,7 @@ void emulator_update(void)
     debug(debug_int, "emu update cycle\n");
     cpuTriggerIRQ(0);
     update_timer();
-    check_screen();
+    video_update();
     update_keyb();
     fflush(stdout);
 }
@@ -237,6 +240,7 @@ int main(int argc, char **argv)
         {
         case 'b':
         case 'r':
+        case 'B':
         case 'X':
             if(argv[i][2])
                 opt = argv[i] + 2;
@@ -279,6 +283,15 @@ int main(int argc, char **argv)
                     print_usage_error("binary run address '%s' invalid.", opt);
             }
             break;
+        case 'B':
+        {
+            // Terminal output benchmark: used for performance testing.
+            int threshold = strtol(opt, &ep, 0);
+            if(*ep || threshold < 0)
+                print_usage_error("benchmark threshold '%s' invalid.", opt);
+            bench_video(threshold);
+            break;
+        }
         case 'X':
         {
             FILE *cf = fopen(opt, "rb");
@@ -310,7 +323,9 @@ int main(int argc, char **argv)
 
     // Init debug facilities
     init_debug(argv[1]);
+    init_shm();
     init_cpu();
+    init_replay();
 
     if(bin_load_addr >= 0)
     {
@@ -343,7 +358,9 @@ int main(int argc, char **argv)
     itv.it_interval.tv_usec = 54925;
     itv.it_value.tv_sec = 0;
     itv.it_value.tv_usec = 54925;
-    setitimer(ITIMER_REAL, &itv, 0);
+    // On replay, the updates are done at the recorded instruction counts
+    if(!replay_active())
+        setitimer(ITIMER_REAL, &itv, 0);
     if(!skip_init_bios)
         init_bios_mem();
     video_init_mem();
@@ -351,6 +368,8 @@ int main(int argc, char **argv)
     {
         exit_cpu = 0;
         execute();
+        if(!replay_input(rr_update, 0))
+            record_input(rr_update, 0);
         emulator_update();
     }
 }
@@ -40,6 +40,13 @@
 #  endif
 #endif
 
+/* Alignment of arrays that can be mapped to other memory */
+#if defined(__GNUC__) || defined(__SUNPRO_C) || defined(__SUNPRO_CC)
+# define PAGE_ALIGNED __attribute__((aligned(0x10000)))
+#else
+# define PAGE_ALIGNED
+#endif
+
 /* Platforms which are missing cfmakeraw() */
 #if defined(__illumos__) || defined(__sun)
 # if !defined(NO_CFMAKERAW)
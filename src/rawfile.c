@@ -0,0 +1,610 @@
+#include "rawfile.h"
+#include "dbg.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RAWFILE_BUF 4096
+// Size of each read-ahead window
+#define RA_SIZE 65536
+// Sequential reads needed to start the read-ahead
+#define RA_MIN_SEQ 2
+
+// A window of the file read by the I/O thread. The state is protected by
+// "ra_lock", the data belongs to the I/O thread while pending.
+enum ra_state
+{
+    RA_IDLE,
+    RA_PENDING,
+    RA_DONE
+};
+struct ra_window
+{
+    enum ra_state state;
+    int fd;
+    off_t pos;
+    ssize_t len;
+    uint8_t *data;
+    struct ra_window *next; // Next in the I/O thread queue
+};
+
+struct rawfile
+{
+    int fd;
+    int read_only;
+    uint8_t *map;     // Mapping of the file, if read only
+    off_t map_size;   // Bytes of the file mapped
+    int eof;          // Set when a read reaches the end of file
+    int dirty;        // The buffer holds data not written to the file
+    off_t pos;        // Current position
+    off_t buf_pos;    // File position of the buffer data
+    unsigned buf_len; // Bytes in the buffer
+    off_t seq_pos;    // Position after the last read
+    int seq_count;    // Number of sequential reads
+    off_t advised;    // End of the mapping requested to the kernel
+    int ra_used;      // Set if a window was started
+    dev_t dev;        // Device and inode of a regular file
+    ino_t ino;
+    int shared;       // Other open files of the same host file
+    struct rawfile *next;
+    struct ra_window ra[2];
+    uint8_t buf[RAWFILE_BUF];
+};
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static struct ra_window *ra_queue;
+static int ra_running;
+
+// Open regular files, to keep the buffers of the same host file coherent
+static struct rawfile *open_files;
+
+// Reads until "len" bytes or the end of file
+static ssize_t full_pread(int fd, uint8_t *buf, size_t len, off_t pos)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, pos + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return done ? (ssize_t)done : -1;
+        if(n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t full_pwrite(int fd, const uint8_t *buf, size_t len, off_t pos)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = pwrite(fd, buf + done, len - done, pos + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return done ? (ssize_t)done : -1;
+        done += n;
+    }
+    return done;
+}
+
+// Reading a mapped page past the end of a file that shrank gives a SIGBUS,
+// the handler jumps back to the copy, that then uses pread. The state is per
+// thread, as the signal is delivered to the thread doing the copy. Other
+// signals are passed to the previous handler.
+static __thread sigjmp_buf map_jmp;
+static __thread volatile sig_atomic_t map_copying;
+static struct sigaction old_sigbus;
+
+static void sigbus_handler(int sig, siginfo_t *info, void *ctx)
+{
+    if(map_copying)
+        siglongjmp(map_jmp, 1);
+    if(old_sigbus.sa_flags & SA_SIGINFO)
+        old_sigbus.sa_sigaction(sig, info, ctx);
+    else if(old_sigbus.sa_handler != SIG_DFL && old_sigbus.sa_handler != SIG_IGN)
+        old_sigbus.sa_handler(sig);
+    else
+    {
+        // Restore the default action, the fault happens again on return
+        sigaction(SIGBUS, &old_sigbus, NULL);
+        if(info->si_code <= 0)
+            raise(SIGBUS);
+    }
+}
+
+static void map_file(struct rawfile *f)
+{
+    static int handler_set;
+    struct stat st;
+    // Empty and special files are read with pread
+    if(fstat(f->fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return;
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if(map == MAP_FAILED)
+        return;
+    if(!handler_set)
+    {
+        // No signal mask is saved in the jump, so don't block SIGBUS
+        struct sigaction sa;
+        sa.sa_sigaction = sigbus_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_NODEFER | SA_SIGINFO;
+        sigaction(SIGBUS, &sa, &old_sigbus);
+        handler_set = 1;
+    }
+    f->map = map;
+    f->map_size = st.st_size;
+}
+
+static void unmap_file(struct rawfile *f)
+{
+    if(f->map)
+        munmap(f->map, f->map_size);
+    f->map = 0;
+    f->map_size = 0;
+}
+
+// Maps the file again if the size changed
+static void check_map_size(struct rawfile *f)
+{
+    struct stat st;
+    if(f->map && !fstat(f->fd, &st) && st.st_size == f->map_size)
+        return;
+    unmap_file(f);
+    map_file(f);
+}
+
+// Copies from the mapping, returns 0 if the file shrank and the mapping was
+// dropped.
+static int map_copy(struct rawfile *f, uint8_t *buf, unsigned len)
+{
+    if(sigsetjmp(map_jmp, 0))
+    {
+        map_copying = 0;
+        unmap_file(f);
+        return 0;
+    }
+    map_copying = 1;
+    memcpy(buf, f->map + f->pos, len);
+    map_copying = 0;
+    return 1;
+}
+
+// Reads the queued windows
+static void *ra_thread(void *arg)
+{
+    pthread_mutex_lock(&ra_lock);
+    while(1)
+    {
+        while(!ra_queue)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        struct ra_window *w = ra_queue;
+        ra_queue = w->next;
+        pthread_mutex_unlock(&ra_lock);
+        ssize_t n = full_pread(w->fd, w->data, RA_SIZE, w->pos);
+        pthread_mutex_lock(&ra_lock);
+        w->len = n > 0 ? n : 0;
+        __atomic_store_n(&w->state, RA_DONE, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ra_cond);
+    }
+    return 0;
+}
+
+// Queues the read of a window, returns 0 if not possible
+static int ra_start(struct rawfile *f, struct ra_window *w, off_t pos)
+{
+    if(!ra_running)
+    {
+        // Signals are handled only by the emulator thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_t id;
+        ra_running = !pthread_create(&id, 0, ra_thread, 0);
+        pthread_sigmask(SIG_SETMASK, &old, 0);
+        if(!ra_running)
+            return 0;
+        pthread_detach(id);
+    }
+    if(!w->data && !(w->data = malloc(RA_SIZE)))
+        return 0;
+    f->ra_used = 1;
+    pthread_mutex_lock(&ra_lock);
+    __atomic_store_n(&w->state, RA_PENDING, __ATOMIC_RELEASE);
+    w->fd = f->fd;
+    w->pos = pos;
+    w->next = 0;
+    struct ra_window **q = &ra_queue;
+    while(*q)
+        q = &(*q)->next;
+    *q = w;
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+    return 1;
+}
+
+// Waits for a pending window
+static void ra_wait(struct ra_window *w)
+{
+    if(__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) != RA_PENDING)
+        return;
+    pthread_mutex_lock(&ra_lock);
+    while(__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) == RA_PENDING)
+        pthread_cond_wait(&ra_cond, &ra_lock);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// Drops the windows, after a write or when the file changes
+static void ra_drop(struct rawfile *f)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        ra_wait(&f->ra[i]);
+        __atomic_store_n(&f->ra[i].state, RA_IDLE, __ATOMIC_RELAXED);
+    }
+    f->ra_used = 0;
+    f->seq_count = 0;
+}
+
+// Returns the window holding the position, waiting for it if pending
+static struct ra_window *ra_find(struct rawfile *f, off_t pos)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        struct ra_window *w = &f->ra[i];
+        enum ra_state st = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+        if(st != RA_IDLE && pos >= w->pos && pos < w->pos + RA_SIZE)
+        {
+            ra_wait(w);
+            return pos < w->pos + w->len ? w : 0;
+        }
+    }
+    return 0;
+}
+
+// Called after each read, starts reading the next windows of the file if
+// the reads are sequential.
+static void read_ahead(struct rawfile *f, off_t start)
+{
+    if(start == f->seq_pos)
+        f->seq_count++;
+    else
+        f->seq_count = 0;
+    f->seq_pos = f->pos;
+    // Don't read data that is still in the buffer
+    if(f->seq_count < RA_MIN_SEQ || f->dirty)
+        return;
+    if(f->map)
+    {
+        // The kernel reads the mapped pages in the background
+        if(f->pos + RA_SIZE / 2 > f->advised)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            off_t pos = f->pos > f->advised ? f->pos : f->advised;
+            pos &= ~(off_t)(page - 1);
+            if(pos < f->map_size)
+                madvise(f->map + pos,
+                        f->map_size - pos < RA_SIZE ? f->map_size - pos : RA_SIZE,
+                        MADV_WILLNEED);
+            f->advised = pos + RA_SIZE;
+        }
+        return;
+    }
+    // Keep the window at the position and the next one read
+    off_t pos = f->pos;
+    for(int n = 0; n < 2; n++)
+    {
+        struct ra_window *w = 0, *free = 0;
+        for(int i = 0; i < 2; i++)
+        {
+            struct ra_window *r = &f->ra[i];
+            enum ra_state st = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+            if(st != RA_IDLE && pos >= r->pos && pos < r->pos + RA_SIZE)
+                w = r;
+            // Reuse windows not near the position
+            else if(st == RA_IDLE || (st == RA_DONE && (r->pos + RA_SIZE <= f->pos ||
+                                                        r->pos >= f->pos + 2 * RA_SIZE)))
+                free = r;
+        }
+        if(!w)
+        {
+            if(!free || !ra_start(f, free, pos))
+                return;
+            w = free;
+        }
+        // Stop at the end of the file
+        if(__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) == RA_DONE && w->len < RA_SIZE)
+            return;
+        pos = w->pos + RA_SIZE;
+    }
+}
+
+// Returns the next open file of the same host file after "g", or the first
+// one if "g" is null.
+static struct rawfile *next_shared(struct rawfile *f, struct rawfile *g)
+{
+    for(g = g ? g->next : open_files; g; g = g->next)
+        if(g != f && g->dev == f->dev && g->ino == f->ino)
+            return g;
+    return 0;
+}
+
+// Writes the buffered data of the other open files of the same host file, so
+// that reads see it. If "drop" is set, also drops the data they read, as the
+// file is going to be modified.
+static void sync_shared(struct rawfile *f, int drop)
+{
+    if(!f->shared)
+        return;
+    for(struct rawfile *g = next_shared(f, 0); g; g = next_shared(f, g))
+    {
+        rawfile_flush(g);
+        if(drop)
+        {
+            g->buf_len = 0;
+            if(g->ra_used)
+                ra_drop(g);
+        }
+    }
+}
+
+struct rawfile *rawfile_open(int fd, int read_only)
+{
+    struct rawfile *f = calloc(1, sizeof(*f));
+    if(!f)
+        print_error("out of memory opening file.\n");
+    f->fd = fd;
+    f->read_only = read_only;
+    struct stat st;
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode))
+    {
+        f->dev = st.st_dev;
+        f->ino = st.st_ino;
+        for(struct rawfile *g = next_shared(f, 0); g; g = next_shared(f, g))
+        {
+            g->shared++;
+            f->shared++;
+        }
+        f->next = open_files;
+        open_files = f;
+    }
+    if(read_only)
+        map_file(f);
+    return f;
+}
+
+int rawfile_flush(struct rawfile *f)
+{
+    if(!f->dirty)
+        return 0;
+    f->dirty = 0;
+    if(full_pwrite(f->fd, f->buf, f->buf_len, f->buf_pos) != (ssize_t)f->buf_len)
+    {
+        f->buf_len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int rawfile_close(struct rawfile *f)
+{
+    int e = rawfile_flush(f);
+    ra_drop(f);
+    for(struct rawfile **p = &open_files; *p; p = &(*p)->next)
+    {
+        if(*p == f)
+        {
+            *p = f->next;
+            break;
+        }
+    }
+    for(struct rawfile *g = next_shared(f, 0); f->shared && g; g = next_shared(f, g))
+        g->shared--;
+    free(f->ra[0].data);
+    free(f->ra[1].data);
+    unmap_file(f);
+    if(close(f->fd))
+        e = -1;
+    free(f);
+    return e;
+}
+
+unsigned rawfile_read(struct rawfile *f, uint8_t *buf, unsigned len)
+{
+    off_t start = f->pos;
+    sync_shared(f, 0);
+    // Mapped files are read from the mapping, checking the size again when
+    // reading past its end. If the file can't be mapped, uses the buffer.
+    if(f->map && f->pos + len > f->map_size)
+        check_map_size(f);
+    if(f->map)
+    {
+        unsigned n = 0;
+        if(f->pos < f->map_size)
+        {
+            n = len;
+            if(n > f->map_size - f->pos)
+                n = f->map_size - f->pos;
+            if(!map_copy(f, buf, n))
+            {
+                check_map_size(f);
+                return rawfile_read(f, buf, len);
+            }
+        }
+        f->pos += n;
+        f->eof = n < len;
+        read_ahead(f, start);
+        return n;
+    }
+    unsigned done = 0;
+    while(done < len)
+    {
+        // Copy from the buffer if it holds the data at the position
+        if(f->pos >= f->buf_pos && f->pos < f->buf_pos + f->buf_len)
+        {
+            unsigned off = f->pos - f->buf_pos;
+            unsigned n = f->buf_len - off;
+            if(n > len - done)
+                n = len - done;
+            memcpy(buf + done, f->buf + off, n);
+            done += n;
+            f->pos += n;
+            continue;
+        }
+        if(rawfile_flush(f))
+            break;
+        // Copy from the read-ahead windows
+        struct ra_window *w = ra_find(f, f->pos);
+        if(w)
+        {
+            unsigned off = f->pos - w->pos;
+            unsigned n = w->len - off;
+            if(n > len - done)
+                n = len - done;
+            memcpy(buf + done, w->data + off, n);
+            done += n;
+            f->pos += n;
+            continue;
+        }
+        // Big reads go directly to the destination
+        if(len - done >= RAWFILE_BUF)
+        {
+            ssize_t n = full_pread(f->fd, buf + done, len - done, f->pos);
+            if(n > 0)
+            {
+                done += n;
+                f->pos += n;
+            }
+            break;
+        }
+        ssize_t n = full_pread(f->fd, f->buf, RAWFILE_BUF, f->pos);
+        f->buf_pos = f->pos;
+        f->buf_len = n > 0 ? n : 0;
+        if(!f->buf_len)
+            break;
+    }
+    f->eof = done < len;
+    read_ahead(f, start);
+    return done;
+}
+
+unsigned rawfile_write(struct rawfile *f, const uint8_t *buf, unsigned len)
+{
+    f->eof = 0;
+    if(!len)
+        return 0;
+    if(f->read_only)
+    {
+        errno = EBADF;
+        return 0;
+    }
+    if(f->ra_used)
+        ra_drop(f);
+    sync_shared(f, 1);
+    // Write into the buffer if the data is inside or just after it
+    if(f->pos < f->buf_pos || f->pos > f->buf_pos + f->buf_len ||
+       f->pos + len > f->buf_pos + RAWFILE_BUF)
+    {
+        if(rawfile_flush(f))
+            return 0;
+        f->buf_pos = f->pos;
+        f->buf_len = 0;
+        if(len >= RAWFILE_BUF)
+        {
+            ssize_t n = full_pwrite(f->fd, buf, len, f->pos);
+            if(n <= 0)
+                return 0;
+            f->pos += n;
+            return n;
+        }
+    }
+    unsigned off = f->pos - f->buf_pos;
+    memcpy(f->buf + off, buf, len);
+    if(off + len > f->buf_len)
+        f->buf_len = off + len;
+    f->dirty = 1;
+    f->pos += len;
+    return len;
+}
+
+off_t rawfile_seek(struct rawfile *f, off_t pos, int whence)
+{
+    if(whence == SEEK_CUR)
+        pos += f->pos;
+    else if(whence == SEEK_END)
+    {
+        struct stat st;
+        sync_shared(f, 0);
+        if(fstat(f->fd, &st))
+            return -1;
+        // The buffer can hold data past the end of the file
+        off_t size = st.st_size;
+        if(f->dirty && f->buf_pos + f->buf_len > size)
+            size = f->buf_pos + f->buf_len;
+        pos += size;
+    }
+    if(pos < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    f->eof = 0;
+    return pos;
+}
+
+int rawfile_truncate(struct rawfile *f)
+{
+    ra_drop(f);
+    sync_shared(f, 1);
+    if(rawfile_flush(f) || ftruncate(f->fd, f->pos))
+        return -1;
+    // Reads inside the mapping don't check the size
+    for(struct rawfile *g = next_shared(f, 0); f->shared && g; g = next_shared(f, g))
+        if(g->map)
+            check_map_size(g);
+    if(f->buf_pos + f->buf_len > f->pos)
+        f->buf_len = f->pos > f->buf_pos ? f->pos - f->buf_pos : 0;
+    return 0;
+}
+
+int rawfile_eof(struct rawfile *f)
+{
+    return f->eof;
+}
+
+int rawfile_fd(struct rawfile *f)
+{
+    return f->fd;
+}
+
+int rawfile_sync_out(struct rawfile *f)
+{
+    if(rawfile_flush(f) || lseek(f->fd, f->pos, SEEK_SET) == -1)
+        return -1;
+    return 0;
+}
+
+void rawfile_sync_in(struct rawfile *f)
+{
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    if(pos != -1)
+        f->pos = pos;
+    f->buf_len = 0;
+    ra_drop(f);
+    // The child process can change the file size
+    if(f->map)
+        check_map_size(f);
+}
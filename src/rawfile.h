@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Buffered access to a host file using the file descriptor directly. The file
+// position is kept in memory, so seeks don't need system calls, and reads and
+// writes use pread and pwrite. One buffer is used for reads and writes, the
+// written data is kept until the buffer is needed or the file is flushed.
+//
+// Read-only files are mapped in memory, reads inside the mapping are copied
+// from it directly. The size is checked again on reads past the end of the
+// mapping, and reads of pages no longer in the file map the file again. Data
+// past a new end of the file in its last page reads as zeros.
+//
+// After a few sequential reads, the next windows of the file are read by a
+// background thread, or requested to the kernel with madvise if mapped.
+//
+// Files opened more than once are kept coherent: reads first write the data
+// buffered by the other open files of the same host file, and writes drop
+// the data they have read.
+struct rawfile;
+
+// Creates the file from an open descriptor, that is closed with the file.
+// Writes fail if "read_only" is set.
+struct rawfile *rawfile_open(int fd, int read_only);
+
+// Flushes and closes the file, returns -1 on error.
+int rawfile_close(struct rawfile *f);
+
+// Reads up to "len" bytes at the current position, returns the bytes read.
+unsigned rawfile_read(struct rawfile *f, uint8_t *buf, unsigned len);
+
+// Writes "len" bytes at the current position, returns the bytes written.
+unsigned rawfile_write(struct rawfile *f, const uint8_t *buf, unsigned len);
+
+// Sets the position as lseek, returns the new position or -1 on error.
+off_t rawfile_seek(struct rawfile *f, off_t pos, int whence);
+
+// Writes the buffered data, returns -1 on error.
+int rawfile_flush(struct rawfile *f);
+
+// Truncates the file at the current position, returns -1 on error.
+int rawfile_truncate(struct rawfile *f);
+
+// Returns true if the last read reached the end of the file.
+int rawfile_eof(struct rawfile *f);
+
+// Returns the file descriptor.
+int rawfile_fd(struct rawfile *f);
+
+// Writes the buffered data and sets the descriptor offset to the position,
+// before sharing the descriptor with another process.
+int rawfile_sync_out(struct rawfile *f);
+
+// Sets the position from the descriptor offset and drops the buffered data,
+// after the descriptor was used by another process.
+void rawfile_sync_in(struct rawfile *f);
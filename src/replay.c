@@ -0,0 +1,136 @@
+#include "replay.h"
+#include "dbg.h"
+#include "emu.h"
+#include "env.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *rr_name;
+static FILE *rec_file;
+static FILE *rep_file;
+
+// Next input from the replay file, ev == 0 at end of file
+static struct
+{
+    uint64_t count;
+    long long value;
+    int ev;
+} next;
+
+static void read_next(void)
+{
+    char ev;
+    if(fscanf(rep_file, "%" SCNu64 " %c %lld", &next.count, &ev, &next.value) != 3)
+    {
+        next.ev = 0;
+        cpu_set_stop_count(UINT64_MAX);
+        return;
+    }
+    next.ev = ev;
+    // Asynchronous updates are reproduced by stopping the CPU at the same count
+    cpu_set_stop_count(ev == rr_update ? next.count : UINT64_MAX);
+}
+
+static void close_record(void)
+{
+    if(rec_file)
+        fclose(rec_file);
+    rec_file = 0;
+}
+
+void init_replay(void)
+{
+    if(getenv(ENV_REPLAY))
+    {
+        rr_name = getenv(ENV_REPLAY);
+        rep_file = fopen(rr_name, "r");
+        if(!rep_file)
+            print_error("can't open replay file '%s': %s\n", rr_name, strerror(errno));
+        read_next();
+    }
+    else if(getenv(ENV_RECORD))
+    {
+        rr_name = getenv(ENV_RECORD);
+        rec_file = fopen(rr_name, "w");
+        if(!rec_file)
+            print_error("can't create record file '%s': %s\n", rr_name, strerror(errno));
+        atexit(close_record);
+    }
+}
+
+int replay_active(void)
+{
+    return rep_file != 0;
+}
+
+int replay_input(enum replay_event ev, long long *value)
+{
+    if(!rep_file)
+        return 0;
+
+    uint64_t count = cpu_get_ins_count();
+    if(!next.ev)
+        print_error("replay: end of file '%s' at instruction %" PRIu64 ".\n", rr_name,
+                    count);
+    if(next.ev != (int)ev || next.count != count)
+        print_error("replay: diverged at instruction %" PRIu64 ", expected '%c' at %" PRIu64
+                    ", got '%c'.\n",
+                    count, next.ev, next.count, ev);
+    if(value)
+        *value = next.value;
+    read_next();
+    return 1;
+}
+
+int replay_next(enum replay_event ev, long long *value)
+{
+    if(!rep_file || next.ev != (int)ev || next.count != cpu_get_ins_count())
+        return 0;
+    *value = next.value;
+    read_next();
+    return 1;
+}
+
+int replay_ended(void)
+{
+    return rep_file && !next.ev;
+}
+
+void record_input(enum replay_event ev, long long value)
+{
+    if(rec_file)
+        fprintf(rec_file, "%" PRIu64 " %c %lld\n", cpu_get_ins_count(), ev, value);
+}
+
+void replay_gettimeofday(struct timeval *tv)
+{
+    long long us;
+    if(replay_input(rr_time, &us))
+    {
+        tv->tv_sec = us / 1000000;
+        tv->tv_usec = us % 1000000;
+        return;
+    }
+    gettimeofday(tv, 0);
+    record_input(rr_time, tv->tv_sec * 1000000LL + tv->tv_usec);
+}
+
+time_t replay_time(void)
+{
+    struct timeval tv;
+    replay_gettimeofday(&tv);
+    return tv.tv_sec;
+}
+
+void replay_child_env(void)
+{
+    if(!rr_name)
+        return;
+    // Use the instruction count of the parent to get an unique file name.
+    char name[strlen(rr_name) + 32];
+    sprintf(name, "%s.%" PRIu64, rr_name, cpu_get_ins_count());
+    setenv(rep_file ? ENV_REPLAY : ENV_RECORD, name, 1);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <sys/time.h>
+#include <time.h>
+
+// Record and replay of the non-deterministic inputs to the emulator.
+//
+// Each input is stored with the count of instructions executed before it, so
+// that a replay feeds it back at exactly the same point of the execution.
+enum replay_event
+{
+    rr_key = 'K',    // Key read from the terminal, with the modifier state
+    rr_line = 'L',   // Character read from the console in line input
+    rr_time = 'T',   // Wall clock time, in microseconds
+    rr_clock = 'C',  // Timer chip counter
+    rr_update = 'U', // Asynchronous emulator update
+};
+
+// Starts recording or replaying, as given in the environment.
+void init_replay(void);
+
+// Returns 1 if the inputs are read from a replay file.
+int replay_active(void);
+
+// Reads the next recorded input, that must be of type "ev", into "value".
+// Returns 0 if not replaying.
+int replay_input(enum replay_event ev, long long *value);
+
+// Reads the next recorded input into "value" if it is of type "ev" at the
+// current instruction, for inputs that are only recorded when present.
+// Returns 0 if not replaying or there is no such input.
+int replay_next(enum replay_event ev, long long *value);
+
+// Returns 1 if all the recorded inputs were replayed.
+int replay_ended(void);
+
+// Writes the input to the recording file, if recording.
+void record_input(enum replay_event ev, long long value);
+
+// Replacements of gettimeofday() and time() that are recorded and replayed.
+void replay_gettimeofday(struct timeval *tv);
+time_t replay_time(void);
+
+// Sets the environment of a child emulator process to record/replay to
+// a new file.
+void replay_child_env(void);
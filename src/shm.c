@@ -0,0 +1,86 @@
+#include "shm.h"
+#include "dbg.h"
+#include "emu.h"
+#include "env.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__GNUC__)
+# define WRITE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+# define WRITE_FENCE()
+#endif
+
+static char *shm_name;
+static pid_t shm_owner;
+static struct emu2_shm_header *header;
+
+static void exit_shm(void)
+{
+    // Child processes that failed to start don't remove the parent object
+    if(getpid() == shm_owner)
+        shm_unlink(shm_name);
+}
+
+void init_shm(void)
+{
+    const char *env = getenv(ENV_SHM);
+    if(!env)
+        return;
+    shm_name = malloc(strlen(env) + 2);
+    sprintf(shm_name, "%s%s", env[0] == '/' ? "" : "/", env);
+
+    if((uintptr_t)memory % sysconf(_SC_PAGESIZE))
+        print_error("shared memory needs page aligned emulated memory.\n");
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        print_error("can't create shared memory '%s': %s\n", shm_name, strerror(errno));
+    if(ftruncate(fd, EMU2_SHM_SIZE))
+        print_error("can't resize shared memory '%s': %s\n", shm_name, strerror(errno));
+    shm_owner = getpid();
+    atexit(exit_shm);
+
+    // Map the object over the memory array, so the emulator accesses it as before
+    if(mmap(memory, EMU2_SHM_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+            0) == MAP_FAILED)
+        print_error("can't map shared memory '%s': %s\n", shm_name, strerror(errno));
+    header = mmap(0, EMU2_SHM_SIZE - EMU2_SHM_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, EMU2_SHM_HEADER);
+    if(header == MAP_FAILED)
+        print_error("can't map shared memory '%s': %s\n", shm_name, strerror(errno));
+    close(fd);
+
+    header->magic = EMU2_SHM_MAGIC;
+    header->version = EMU2_SHM_VERSION;
+    header->mem_size = EMU2_SHM_HEADER;
+}
+
+struct emu2_shm_header *shm_begin_update(void)
+{
+    if(!header)
+        return 0;
+    header->seq++;
+    WRITE_FENCE();
+    return header;
+}
+
+void shm_end_update(void)
+{
+    WRITE_FENCE();
+    header->seq++;
+}
+
+void shm_child_env(void)
+{
+    if(!shm_name)
+        return;
+    char name[strlen(shm_name) + 8];
+    sprintf(name, "%s.child", shm_name + 1);
+    setenv(ENV_SHM, name, 1);
+}
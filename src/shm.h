@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Export of the emulated memory and the video state in a shared memory
+// object, for external programs that inspect the running emulator.
+//
+// The object holds the emulated memory at offset 0, followed by the header
+// at offset EMU2_SHM_HEADER. The header is updated at each screen update,
+// "seq" is odd while the header is being written, so readers must retry if
+// it is odd or changed after reading the other fields.
+#define EMU2_SHM_MAGIC   0x32554D45 // "EMU2"
+#define EMU2_SHM_VERSION 1
+#define EMU2_SHM_HEADER  0x110000
+#define EMU2_SHM_SIZE    0x120000
+
+struct emu2_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mem_size;  // Size of the emulated memory
+    uint32_t seq;       // Frame sequence counter, incremented by 2 each update
+    uint32_t page_addr; // Address of the displayed video page
+    uint16_t video_mode;
+    uint16_t cols, rows;
+    uint16_t page;
+    uint16_t cursor_x, cursor_y;
+    uint16_t cursor_on;
+};
+
+// Maps the emulated memory to the shared memory object given in the
+// environment. Must be called before the memory is written.
+void init_shm(void);
+
+// Starts an update of the header, returns null if not exporting.
+struct emu2_shm_header *shm_begin_update(void);
+
+// Ends the update started above.
+void shm_end_update(void);
+
+// Sets the environment of a child emulator process to export to another
+// object.
+void shm_child_env(void);
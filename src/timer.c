@@ -2,9 +2,10 @@
 #include "timer.h"
 #include "dbg.h"
 #include "emu.h"
+#include "replay.h"
+#include "utils.h"
 
 #include <inttypes.h>
-#include <math.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -26,7 +27,7 @@ static int64_t time_to_bios(struct timeval tv)
 void update_timer(void)
 {
     struct timeval tv;
-    gettimeofday(&tv, 0);
+    replay_gettimeofday(&tv);
     if(start_timer == 0) {
         // Create a time_t value at the start of the day, in local time
         struct timeval td = tv;
@@ -48,7 +49,7 @@ void update_timer(void)
 static void set_timer(unsigned x)
 {
     struct timeval tv;
-    gettimeofday(&tv, 0);
+    replay_gettimeofday(&tv);
     start_timer = time_to_bios(tv) + x;
     update_timer();
 }
@@ -57,7 +58,7 @@ static void set_timer(unsigned x)
 // TODO: emulate timer interrupts.
 static struct i8253_timer
 {
-    long load_time;
+    uint64_t load_time;
     uint16_t load_value;
     uint16_t rd_latch;
     uint16_t wr_latch;
@@ -73,18 +74,41 @@ static struct i8253_timer
 #define TIMER_WORD_L 2
 #define TIMER_WORD_M 3
 
-// Returns port timer at 1193179.97HZ
-static long get_timer_clock(void)
+// The host clock is read at most once each CLOCK_SAMPLE_INS instructions, in
+// between the timer is interpolated using the executed instruction count.
+#define CLOCK_SAMPLE_INS 256
+
+// Returns port timer at 1193181.8HZ, the counter is monotonic.
+static uint64_t get_timer_clock(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    // us in microseconds
-    // (don't use full seconds resolution, to avoid losing precision
-    double us = (tv.tv_sec & 0xFFFFFF) * 1000000.0 + tv.tv_usec;
-    // Convert to "counts"
-    us = us * (105.0 / 88.0);
-    // And return as long (64 bits)
-    return lrint(us);
+    static uint64_t last_clock, sample_clock, sample_ins;
+    static uint64_t ticks_per_kins; // Timer ticks each 1024 instructions
+    uint64_t ins = cpu_get_ins_count();
+    uint64_t clock;
+    if(sample_clock && ins - sample_ins < CLOCK_SAMPLE_INS)
+        clock = sample_clock + (((ins - sample_ins) * ticks_per_kins) >> 10);
+    else
+    {
+        long long now;
+        if(!replay_input(rr_clock, &now))
+        {
+            now = emu_get_ticks(1193182);
+            record_input(rr_clock, now);
+        }
+        // Estimate the rate only from consecutive samples, as the CPU could
+        // have been idle in between.
+        ticks_per_kins = 0;
+        if(sample_clock && ins - sample_ins < 4 * CLOCK_SAMPLE_INS &&
+           (uint64_t)now > sample_clock)
+            ticks_per_kins = (((uint64_t)now - sample_clock) << 10) / (ins - sample_ins);
+        sample_clock = now;
+        sample_ins = ins;
+        clock = now;
+    }
+    // Don't go back if the clock is not monotonic or the estimate was too high
+    if(clock > last_clock)
+        last_clock = clock;
+    return last_clock;
 }
 
 // Get actual value in timer
@@ -274,7 +298,7 @@ void intr1A(void)
     }
     case 2: // GET RTC TIME
     {
-        time_t tm = time(0);
+        time_t tm = replay_time();
         struct tm lt;
         if(localtime_r(&tm, &lt))
         {
@@ -285,7 +309,7 @@ void intr1A(void)
     }
     case 4: // GET RTC DATE
     {
-        time_t tm = time(0);
+        time_t tm = replay_time();
         struct tm lt;
         if(localtime_r(&tm, &lt))
         {
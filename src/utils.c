@@ -1,6 +1,7 @@
 /* Platform dependent utility functions */
 #include "utils.h"
 #include "dbg.h"
+#include <errno.h>
 #include <unistd.h>
 
 #ifdef __APPLE__
@@ -116,10 +117,10 @@ void emu_advance_time(int us, EMU_CLOCK_TYPE *tm)
     }
 
     tm->CLK_MIN += us * CLK_MULT;
-    while(tm->tv_nsec >= CLK_SEC)
+    while(tm->CLK_MIN >= CLK_SEC)
     {
         tm->tv_sec++;
-        tm->tv_nsec -= CLK_SEC;
+        tm->CLK_MIN -= CLK_SEC;
     }
 }
 
@@ -137,3 +138,44 @@ int emu_compare_time(EMU_CLOCK_TYPE *target)
     emu_get_time(&now);
     return emu_compare_times(&now, target);
 }
+
+/* Returns the difference "left - right" in microseconds. */
+long long emu_diff_time(EMU_CLOCK_TYPE *left, EMU_CLOCK_TYPE *right)
+{
+    return (left->tv_sec - right->tv_sec) * 1000000LL +
+           (left->CLK_MIN - right->CLK_MIN) / CLK_MULT;
+}
+
+/* Returns the current time in ticks of a clock of "freq" Hz. */
+uint64_t emu_get_ticks(uint32_t freq)
+{
+    EMU_CLOCK_TYPE now;
+    emu_get_time(&now);
+    /* Integer only: both products fit in 64 bits for any 32 bit frequency
+     * and the fraction is always less than "freq", so this is monotonic. */
+    return (uint64_t)now.tv_sec * freq + (uint64_t)now.CLK_MIN * freq / CLK_SEC;
+}
+
+/* Sleeps until the given absolute time, returns the number of microseconds
+ * that the current time is past the target after waking up. */
+long long emu_sleep_until(EMU_CLOCK_TYPE *target)
+{
+    EMU_CLOCK_TYPE now;
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+    /* Absolute deadline, so early wake-ups and signals don't accumulate error */
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, target, 0) == EINTR)
+        ;
+    emu_get_time(&now);
+#else
+    /* Relative sleep, only once - the caller corrects any drift */
+    emu_get_time(&now);
+    long long us = emu_diff_time(target, &now);
+    if(us > 0)
+    {
+        usleep(us);
+        emu_get_time(&now);
+    }
+#endif
+    long long late = emu_diff_time(&now, target);
+    return late > 0 ? late : 0;
+}
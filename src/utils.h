@@ -1,6 +1,8 @@
 /* Platform dependent utility functions */
 #pragma once
 
+#include <stdint.h>
+
 /* Returns the full path to the program executable */
 const char *get_program_exe_path(void);
 
@@ -22,3 +24,13 @@ void emu_advance_time(int us, EMU_CLOCK_TYPE *tm);
 
 /* Returns true if current time is more than target */
 int emu_compare_time(EMU_CLOCK_TYPE *target);
+
+/* Returns the difference "left - right" in microseconds. */
+long long emu_diff_time(EMU_CLOCK_TYPE *left, EMU_CLOCK_TYPE *right);
+
+/* Returns the current time in ticks of a clock of "freq" Hz. */
+uint64_t emu_get_ticks(uint32_t freq);
+
+/* Sleeps until the given absolute time, returns the number of microseconds
+ * that the current time is past the target after waking up. */
+long long emu_sleep_until(EMU_CLOCK_TYPE *target);
@@ -1,12 +1,17 @@
 #include "video.h"
+#include "cast.h"
 #include "codepage.h"
 #include "dbg.h"
 #include "emu.h"
 #include "env.h"
 #include "keyb.h"
+#include "shm.h"
+#include "utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +19,12 @@
 #include <termios.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Color cell: une byte for the value and one for the color
 union term_cell
 {
@@ -44,14 +55,90 @@ static unsigned vid_font_lines, vid_scan_lines;
 // Signals that the terminal size needs updating
 static volatile int term_needs_update;
 // Terminal FD, allows video output even with redirection.
-static FILE *tty_file;
+static int tty_fd = -1;
+// Headless mode: the screen is only kept in the video memory.
+static int headless;
+// Output file and counters for the benchmark, set before initializing.
+static int bench_fd = -1;
+static struct video_stats *term_stats;
+// File to write the final screen at exit, with colors if "dump_ansi".
+static FILE *dump_file;
+static int dump_ansi;
+// Output to the terminal, written at once after each screen update. There are
+// two buffers, so one is written while the next update is drawn to the other.
+// The buffers grow to hold a full update, as they are never written to the
+// terminal while drawing.
+#define TERM_BUF_SIZE 65536
+static char *term_buf, *term_out;
+static unsigned term_buf_len, term_buf_size, term_out_size;
+// Minimum time between periodic updates in ms, and time of the last one.
+static unsigned frame_ms;
+static uint64_t last_frame;
+// A key was pressed after the last screen update.
+static int key_pressed;
+// Wrap screen updates in synchronized output mode.
+static int term_sync;
 // Video is already initialized
 static int video_initialized;
 // Actual cursor position in the CRTC register
 static uint16_t crtc_cursor_loc;
+// Modified blocks of video memory, only those are compared with the terminal.
+uint8_t video_dirty[0x8000 >> VIDEO_DIRTY_SHIFT];
+// Lines scrolled out of the top of the screen, not yet sent to the terminal.
+// The buffer grows up to the maximum while the terminal is behind, then the
+// emulator waits for the render thread.
+#define MAX_SCROLL_LINES 65536
+static uint16_t (*scroll_lines)[80];
+static unsigned scroll_count, scroll_size;
+// Copy of the displayed page taken by the emulator at each update, the render
+// thread draws it to the terminal.
+static struct
+{
+    uint16_t cells[64 * 256];
+    uint8_t rows[64]; // Rows changed after the last draw
+    unsigned sx, sy, cursor, cursor_loc;
+    int ready;
+} snap;
+// The render thread state. The lock protects the snapshot and all the terminal
+// state; the write lock is held while writing to the terminal.
+static pthread_t render_id;
+static pthread_mutex_t term_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_done = PTHREAD_COND_INITIALIZER;
+static int render_running, render_quit;
+// Set while the thread holds the lock, to not wait for it on exit, and to
+// count the writes to the terminal done with the lock held.
+static __thread int term_locked;
+// Memory for the terminal output could not be allocated
+static int term_no_memory;
+// Scroll of a window of the screen not yet sent to the terminal: rows y0 to y1
+// are scrolled up "n" lines, or down if negative.
+static struct
+{
+    unsigned y0, y1;
+    int n;
+    uint8_t color;
+} win_scroll;
+
+static void lock_term(void)
+{
+    pthread_mutex_lock(&term_lock);
+    term_locked = 1;
+}
+
+// Unlocks the terminal state, exits if there was no memory for the output
+static void unlock_term(void)
+{
+    term_locked = 0;
+    pthread_mutex_unlock(&term_lock);
+    if(term_no_memory)
+        print_error("out of memory for the terminal output.\n");
+}
 
 // Forward
 static void term_goto_xy(unsigned x, unsigned y);
+static void *render_thread(void *arg);
 
 // Signal handler - terminal size changed
 // TODO: not used yet.
@@ -71,10 +158,118 @@ static union term_cell get_cell(uint8_t chr, uint8_t color)
     return c;
 }
 
+// Writes a block of data to the terminal
+static void term_write(const char *buf, unsigned len)
+{
+    cast_output(buf, len);
+    if(term_stats)
+    {
+        term_stats->bytes += len;
+        term_stats->writes++;
+        term_stats->locked_writes += term_locked;
+        for(const char *p = buf; (p = memchr(p, '\x1b', buf + len - p)); p++)
+            term_stats->escapes++;
+    }
+    unsigned pos = 0;
+    while(pos < len)
+    {
+        ssize_t n = write(tty_fd, buf + pos, len - pos);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        pos += n;
+    }
+}
+
+// Records a change of the screen size in the session recording
+static void term_resize(void)
+{
+    pthread_mutex_lock(&write_lock);
+    cast_resize(vid_sx, vid_sy);
+    pthread_mutex_unlock(&write_lock);
+}
+
+// Writes all the buffered output to the terminal, after any output being
+// written by the render thread.
+static void term_flush(void)
+{
+    pthread_mutex_lock(&write_lock);
+    term_write(term_buf, term_buf_len);
+    pthread_mutex_unlock(&write_lock);
+    term_buf_len = 0;
+}
+
+// Makes room for "len" more bytes in the buffer, returns 0 if there is no
+// memory. The error is reported by the emulator after unlocking, as exiting
+// with the lock held would wait forever for it.
+static int term_grow(unsigned len)
+{
+    if(term_buf_len + len <= term_buf_size)
+        return 1;
+    unsigned size = term_buf_size ? term_buf_size * 2 : TERM_BUF_SIZE;
+    while(size < term_buf_len + len)
+        size *= 2;
+    char *buf = realloc(term_buf, size);
+    if(!buf)
+    {
+        term_no_memory = 1;
+        return 0;
+    }
+    term_buf = buf;
+    term_buf_size = size;
+    return 1;
+}
+
+static void term_putc(char c)
+{
+    if(term_buf_len >= term_buf_size && !term_grow(1))
+        return;
+    term_buf[term_buf_len++] = c;
+}
+
+static void term_puts(const char *s)
+{
+    while(*s)
+        term_putc(*s++);
+}
+
+// Returns the number of decimal digits of "n"
+static unsigned num_len(unsigned n)
+{
+    unsigned l = 1;
+    for(; n >= 10; n /= 10)
+        l++;
+    return l;
+}
+
+// Outputs an escape sequence with one numeric parameter, omitted if it is 1
+static void term_csi(unsigned n, char cmd)
+{
+    term_putc('\x1b');
+    term_putc('[');
+    if(n != 1)
+    {
+        char num[12];
+        int l = num_len(n);
+        for(int i = l - 1; i >= 0; i--, n /= 10)
+            num[i] = '0' + n % 10;
+        for(int i = 0; i < l; i++)
+            term_putc(num[i]);
+    }
+    term_putc(cmd);
+}
+
+// Returns the length of the sequence output by term_csi
+static unsigned csi_len(unsigned n)
+{
+    return n == 1 ? 3 : 3 + num_len(n);
+}
+
 static void term_get_size(void)
 {
     struct winsize ws;
-    if(ioctl(fileno(tty_file), TIOCGWINSZ, &ws) != -1 &&
+    if(ioctl(tty_fd, TIOCGWINSZ, &ws) != -1 &&
        ws.ws_col >= 40 &&
        ws.ws_row >= 12)
     {
@@ -136,6 +331,12 @@ static void reload_posxy_all(void)
     }
 }
 
+// Forces a compare of all the video memory with the terminal
+static void mark_all_dirty(void)
+{
+    memset(video_dirty, VIDEO_DIRTY_ALL, sizeof(video_dirty));
+}
+
 // Clears the terminal data - not the actual terminal screen
 static void clear_terminal(void)
 {
@@ -147,9 +348,12 @@ static void clear_terminal(void)
     output_row = -1;
     term_posx = 0;
     term_posy = 0;
+    scroll_count = 0;
+    win_scroll.n = 0;
+    mark_all_dirty();
     // Get current terminal size
     term_get_size();
-    putc('\r', tty_file); // Go to column 0
+    term_putc('\r'); // Go to column 0
 }
 
 static void set_text_mode(int mode, int clear)
@@ -161,6 +365,7 @@ static void set_text_mode(int mode, int clear)
         uint16_t *vm = (uint16_t *)(memory + 0xB8000);
         for(int i = 0; i < 16384; i++)
             vm[i] = get_cell(0x20, 0x07).value;
+        mark_all_dirty();
     }
     for(int i = 0; i < 8; i++)
     {
@@ -183,6 +388,7 @@ static void set_text_mode(int mode, int clear)
     vid_sx = mode < 2 ? 40 : 80;
     vid_sy = 25;
     vid_font_lines = vid_scan_lines / vid_sy;
+    term_resize();
     // Fill memory block
     memory[0x449] = mode;                             // video mode
     memory[0x44A] = vid_sx;                           // screen columns
@@ -213,35 +419,167 @@ static unsigned get_last_used_row(void)
     return max;
 }
 
+// Starts the render thread, with all signals handled by the emulator
+static void start_render_thread(void)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    render_quit = 0;
+    render_running = !pthread_create(&render_id, 0, render_thread, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+// Waits until the render thread draws the last snapshot and exits
+static void stop_render_thread(void)
+{
+    if(!render_running)
+        return;
+    lock_term();
+    render_quit = 1;
+    pthread_cond_signal(&render_cond);
+    unlock_term();
+    pthread_join(render_id, 0);
+    render_running = 0;
+}
+
+// Don't fork while the terminal is being written, the child process has no
+// render thread.
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&term_lock);
+    pthread_mutex_lock(&write_lock);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&write_lock);
+    pthread_mutex_unlock(&term_lock);
+}
+
+static void fork_child(void)
+{
+    render_running = 0;
+    snap.ready = 0;
+    fork_parent();
+}
+
+// Writes a DOS character to a file in UTF-8
+static void dump_vc(FILE *f, uint8_t c)
+{
+    const struct cp_utf8 *u = get_utf8(c);
+    fwrite(u->str, 1, u->len, f);
+}
+
+// Writes the displayed page to the dump file, up to the last row used.
+static void dump_screen(void)
+{
+    static char cn[8] = "04261537";
+    uint16_t memp = (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
+    const union term_cell *vm = (const union term_cell *)(memory + 0xB8000 + memp);
+
+    unsigned rows = 0;
+    for(unsigned y = 0; y < vid_sy; y++)
+        for(unsigned x = 0; x < vid_sx; x++)
+            if(vm[x + y * vid_sx].chr != 0x20 && vm[x + y * vid_sx].chr != 0)
+                rows = y + 1;
+    for(unsigned y = 0; y < rows; y++)
+    {
+        const union term_cell *row = vm + y * vid_sx;
+        // Trailing blanks are removed, except when they have a background color
+        unsigned len = vid_sx;
+        while(len && (row[len - 1].chr == 0x20 || row[len - 1].chr == 0) &&
+              (!dump_ansi || !(row[len - 1].color & 0x70)))
+            len--;
+        int color = -1;
+        for(unsigned x = 0; x < len; x++)
+        {
+            uint8_t c = row[x].color & 0x7F;
+            if(dump_ansi && c != color)
+            {
+                fprintf(dump_file, "\x1b[%d;3%c;4%cm", (c & 0x08) ? 1 : 0, cn[c & 7],
+                        cn[(c >> 4) & 7]);
+                color = c;
+            }
+            dump_vc(dump_file, row[x].chr ? row[x].chr : 0x20);
+        }
+        if(dump_ansi && color >= 0)
+            fputs("\x1b[m", dump_file);
+        fputc('\n', dump_file);
+    }
+    if(dump_file != stdout)
+        fclose(dump_file);
+    else
+        fflush(stdout);
+}
+
 static void exit_video(void)
 {
+    if(dump_file)
+        dump_screen();
+    if(headless)
+        return;
+    // On errors or signals, exit can be called with the lock held, or from the
+    // render thread: only restore the terminal attributes.
+    if(term_locked || (render_running && pthread_equal(pthread_self(), render_id)))
+    {
+        static const char reset[] = "\x1b[?7h\x1b[m\r\n";
+        if(write(tty_fd, reset, sizeof(reset) - 1) < 0)
+            debug(debug_video, "can't restore the terminal.\n");
+        return;
+    }
     vid_cursor = 1;
     check_screen();
+    stop_render_thread();
     unsigned max = get_last_used_row();
     term_goto_xy(0, max);
-    fputs("\x1b[?7h", tty_file); // Re-enable margin
-    fputs("\x1b[m", tty_file);
-    fclose(tty_file);
+    term_puts("\x1b[?7h"); // Re-enable margin
+    term_puts("\x1b[m");
+    term_flush();
+    cast_close();
+    close(tty_fd);
     debug(debug_video, "exit video - row %u\n", max);
 }
 
 static void init_video(void)
 {
     debug(debug_video, "starting video emulation.\n");
-    int tty_fd = open("/dev/tty", O_NOCTTY | O_WRONLY);
-    if(tty_fd < 0)
-        print_error("error at open TTY, %s\n", strerror(errno));
-    tty_file = fdopen(tty_fd, "w");
-    if(!tty_file)
-        print_error("error at open TTY, %s\n", strerror(errno));
-    fputs("\x1b[?7l", tty_file); // Disable automatic margin
+    const char *dump = getenv(ENV_DUMP);
+    if(dump)
+    {
+        dump_file = strcmp(dump, "-") ? fopen(dump, "w") : stdout;
+        if(!dump_file)
+            print_error("can't create screen dump '%s': %s\n", dump, strerror(errno));
+        dump_ansi = getenv(ENV_DUMP_ANSI) && atoi(getenv(ENV_DUMP_ANSI));
+    }
     atexit(exit_video);
     video_initialized = 1;
+    // Without a terminal, the screen is only kept in video memory
+    headless = getenv(ENV_HEADLESS) && atoi(getenv(ENV_HEADLESS));
+    if(headless)
+        return;
+
+    tty_fd = bench_fd >= 0 ? bench_fd : open("/dev/tty", O_NOCTTY | O_WRONLY);
+    if(tty_fd < 0)
+        print_error("error at open TTY, %s\n", strerror(errno));
+    cast_open(vid_sx, vid_sy);
+    term_puts("\x1b[?7l"); // Disable automatic margin
+    term_sync = getenv(ENV_TERMSYNC) && atoi(getenv(ENV_TERMSYNC));
+    if(getenv(ENV_FPS) && atoi(getenv(ENV_FPS)) > 0)
+        frame_ms = 1000 / atoi(getenv(ENV_FPS));
 
     clear_terminal();
     term_needs_update = 0;
     term_cursor = 1;
-    term_color = 0x07;
+    // Color is not known, force setting all attributes
+    term_color = 0x100;
+
+    // The benchmark draws in the emulator thread, to count the output of each update
+    if(bench_fd >= 0)
+        return;
+
+    start_render_thread();
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 }
 
 int video_active(void)
@@ -249,21 +587,68 @@ int video_active(void)
     return video_initialized;
 }
 
+void video_bench_init(int fd, struct video_stats *stats)
+{
+    bench_fd = fd;
+    term_stats = stats;
+    if(!video_initialized)
+        init_video();
+}
+
+void video_bench_render(int fd)
+{
+    if(fd >= 0)
+    {
+        tty_fd = fd;
+        start_render_thread();
+    }
+    else
+    {
+        stop_render_thread();
+        tty_fd = bench_fd;
+    }
+}
+
+// Sets the terminal attributes, only the ones that changed are output
 static void set_color(uint8_t c)
 {
-    if(term_color != c)
+    static char cn[8] = "04261537";
+    unsigned diff = term_color ^ c;
+    // Blink bit is not used
+    if(diff & 0x17F)
     {
-        static char cn[8] = "04261537";
-        fprintf(tty_file, "\x1b[%c;3%c;4%cm", (c & 0x08) ? '1' : '0', cn[c & 7],
-                cn[(c >> 4) & 7]);
-        term_color = c;
+        term_puts("\x1b[");
+        if(term_color > 0xFF)
+        {
+            term_putc((c & 0x08) ? '1' : '0');
+            diff = 0x7F;
+        }
+        else if(diff & 0x08)
+            term_puts((c & 0x08) ? "1" : "22");
+        if(diff & 0x07)
+        {
+            if(diff & 0x08)
+                term_putc(';');
+            term_putc('3');
+            term_putc(cn[c & 7]);
+        }
+        if(diff & 0x70)
+        {
+            if(diff & 0x0F)
+                term_putc(';');
+            term_putc('4');
+            term_putc(cn[(c >> 4) & 7]);
+        }
+        term_putc('m');
     }
+    term_color = c;
 }
 
 static void vid_set_font(unsigned lines)
 {
     if(vid_font_lines == lines || lines < 4 || lines > 32)
         return; // No change
+    lock_term();
     // Get current and new number of "used" rows:
     unsigned max = get_last_used_row();
     unsigned rows = vid_scan_lines / lines;
@@ -278,13 +663,15 @@ static void vid_set_font(unsigned lines)
     {
         term_goto_xy(0, rows - 1);
         set_color(0x07);
-        fputs("\x1b[J", tty_file);
+        term_puts("\x1b[J");
         for(int y = rows; y < 64; y++)
             for(int x = 0; x < 256; x++)
                 term_screen[y][x] = get_cell(0x20, 0x07);
         if(output_row > (int)rows - 1)
             output_row = rows - 1;
+        mark_all_dirty();
     }
+    unlock_term();
     // Set new mode:
     vid_sy = rows;
     vid_font_lines = lines;
@@ -292,6 +679,7 @@ static void vid_set_font(unsigned lines)
     memory[0x485] = vid_font_lines;
     memory[0x486] = 0;
     update_posxy();
+    term_resize();
 }
 
 void video_init_mem(void)
@@ -324,20 +712,40 @@ void video_init_mem(void)
 // Writes a DOS character to the current terminal position
 static void put_vc(uint8_t c)
 {
-    uint16_t uc = get_unicode(c);
-    if(uc < 128)
-        putc(uc, tty_file);
-    else if(uc < 0x800)
-    {
-        putc(0xC0 | (uc >> 6), tty_file);
-        putc(0x80 | (uc & 0x3F), tty_file);
-    }
-    else
+    const struct cp_utf8 *u = get_utf8(c);
+    for(unsigned i = 0; i < u->len; i++)
+        term_putc(u->str[i]);
+}
+
+// Writes the DOS characters of "n" screen cells to the current terminal position
+static void put_vc_cells(const uint16_t *cells, unsigned n)
+{
+    if(!term_grow(n * 3))
+        return;
+    term_buf_len += cp_to_utf8(term_buf + term_buf_len, (const uint8_t *)cells, n, 2);
+}
+
+// Returns the length of the output of put_vc
+static unsigned vc_len(uint8_t c)
+{
+    return get_utf8(c)->len;
+}
+
+// Returns the number of bytes needed to move the cursor right to column "x" by
+// writing again the characters already on the screen, or 0 if not possible.
+static unsigned rewrite_len(unsigned x)
+{
+    unsigned len = 0;
+    if(x > term_posx + 8 || term_posx >= term_sx || (int)term_posy > output_row)
+        return 0;
+    for(unsigned i = term_posx; i < x; i++)
     {
-        putc(0xE0 | (uc >> 12), tty_file);
-        putc(0x80 | ((uc >> 6) & 0x3F), tty_file);
-        putc(0x80 | (uc & 0x3F), tty_file);
+        union term_cell cell = term_screen[term_posy][i];
+        if((cell.color ^ term_color) & 0x7F)
+            return 0;
+        len += vc_len(cell.chr);
     }
+    return len;
 }
 
 // Move terminal cursor to the position
@@ -349,32 +757,52 @@ static void term_goto_xy(unsigned x, unsigned y)
     if(term_posy < y && (int)term_posy < output_row)
     {
         int inc = (int)y < output_row ? y - term_posy : output_row - term_posy;
-        fprintf(tty_file, "\x1b[%dB", inc);
+        term_csi(inc, 'B');
         term_posy += inc;
     }
     if(term_posy < y)
     {
-        putc('\r', tty_file);
+        term_putc('\r');
         // Set background color to black, as some terminals insert lines with
         // the current background color.
         set_color(term_color & 0x0F);
         // TODO: Draw new line with background color from video screen
         for(unsigned i = term_posy; i < y; i++)
-            putc('\n', tty_file);
+            term_putc('\n');
         term_posx = 0;
         term_posy = y;
     }
     if(term_posy > y)
     {
-        fprintf(tty_file, "\x1b[%uA", term_posy - y);
+        term_csi(term_posy - y, 'A');
         term_posy = y;
     }
     if(x != term_posx)
     {
-        if(term_posx != 0)
-            putc('\r', tty_file);
-        if(x != 0)
-            fprintf(tty_file, "\x1b[%uC", x);
+        // Use the shortest of: CR, CR and move right, absolute column, relative
+        // move or writing again the characters in between. Relative moves are
+        // not used from the last column, as the real cursor position is not
+        // known.
+        unsigned cost = x ? 1 + csi_len(x) : 1;
+        unsigned cost_cha = csi_len(x + 1);
+        unsigned cost_rel = term_posx >= term_sx ? cost
+                            : csi_len(x > term_posx ? x - term_posx : term_posx - x);
+        unsigned cost_rw = x > term_posx ? rewrite_len(x) : 0;
+        if(cost_rw && cost_rw <= cost && cost_rw <= cost_rel && cost_rw <= cost_cha)
+        {
+            for(unsigned i = term_posx; i < x; i++)
+                put_vc(term_screen[term_posy][i].chr);
+        }
+        else if(cost_rel < cost && cost_rel <= cost_cha)
+            term_csi(x > term_posx ? x - term_posx : term_posx - x, x > term_posx ? 'C' : 'D');
+        else if(cost_cha < cost)
+            term_csi(x + 1, 'G');
+        else
+        {
+            term_putc('\r');
+            if(x != 0)
+                term_csi(x, 'C');
+        }
         term_posx = x;
     }
 }
@@ -394,82 +822,497 @@ static void put_vc_xy(uint8_t vc, uint8_t color, unsigned x, unsigned y)
         output_row = term_posy;
 }
 
-// Save screen dump to video log
+// Save screen changes to video log: only the rows that changed from the last
+// dump are written, with the frame number. All the rows are written in a
+// keyframe each DEBUG_KEYFRAME frames, or when the screen size or page changes.
+#define DEBUG_KEYFRAME 256
 static void debug_screen(void)
 {
     // Exit if not in video mode
     if(!video_initialized || !debug_active(debug_video))
         return;
 
+    static char dbg_screen[64][256];
+    static unsigned dbg_frame, dbg_key, dbg_sx, dbg_sy, dbg_page;
+    static char buf[64 * 264 + 64];
+
     uint16_t memp = (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
     uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
 
-    // Dump screen
-    char *buf = malloc(3 * vid_sx + 8);
-    if(!buf)
-        return;
-//    debug(debug_video, "- screen dump -\n");
-    for(unsigned y = 0; y < vid_sy; y++)
+    int keyframe = dbg_frame == dbg_key || vid_sx != dbg_sx || vid_sy != dbg_sy ||
+                   vid_page != dbg_page;
+    if(keyframe)
+    {
+        dbg_key = dbg_frame + DEBUG_KEYFRAME;
+        dbg_sx = vid_sx;
+        dbg_sy = vid_sy;
+        dbg_page = vid_page;
+    }
+    unsigned len = sprintf(buf, "frame %u%s\n", dbg_frame, keyframe ? " keyframe" : "");
+    unsigned rows = 0;
+    for(unsigned y = 0; y < vid_sy && y < 64; y++)
     {
+        char row[256];
         for(unsigned x = 0; x < vid_sx; x++)
         {
-            // Output character
             union term_cell cell;
-            int16_t vc = vm[x + y * vid_sx];
-            cell.value = vc;
-            buf[x] = cell.chr;
+            cell.value = vm[x + y * vid_sx];
+            row[x] = cell.chr;
         }
-        buf[vid_sx] = 0;
-        debug(debug_video, "%02u: %s\n", y, buf);
+        if(!keyframe && !memcmp(row, dbg_screen[y], vid_sx))
+            continue;
+        memcpy(dbg_screen[y], row, vid_sx);
+        len += sprintf(buf + len, "%02u: %.*s\n", y, vid_sx, row);
+        rows++;
     }
-    free(buf);
+    dbg_frame++;
+    // Write all the changes at once
+    if(rows)
+        debug(debug_video, "%s", buf);
 }
 
-// Compares current screen with memory data
-void check_screen(void)
+// Returns the range of dirty flags of the video memory from "memp", with "len" bytes
+static unsigned dirty_range(unsigned memp, unsigned len, unsigned *end)
 {
-    // Exit if not in video mode
-    if(!video_initialized)
-        return;
+    *end = (memp + len - 1) >> VIDEO_DIRTY_SHIFT;
+    if(*end >= sizeof(video_dirty))
+        *end = sizeof(video_dirty) - 1;
+    return memp >> VIDEO_DIRTY_SHIFT;
+}
 
-    debug(debug_video, "check_screen, redrawing\n");
-    debug_screen();
+// Returns true if the row has any of the "flags" set, that are cleared on
+// each screen update or text search.
+static int row_dirty(unsigned memp, unsigned y, uint8_t flags)
+{
+    unsigned len = vid_sx * 2, end;
+    unsigned i = dirty_range(memp + y * len, len, &end);
+    // Rows outside the video memory are always compared
+    if(memp + (y + 1) * len > 0x8000)
+        return 1;
+    for(; i <= end; i++)
+        if(video_dirty[i] & flags)
+            return 1;
+    return 0;
+}
 
-    uint16_t memp = (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
-    uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
-    unsigned max = output_row + 1;
-    for(unsigned y = output_row + 1; y < vid_sy; y++)
-        for(unsigned x = 0; x < vid_sx; x++)
-            if(vm[x + y * vid_sx] != term_screen[y][x].value)
-                max = y + 1;
+// Returns the index of the first cell that differs in "a" and "b", or "n" if
+// all cells are equal.
+static unsigned first_diff(const uint16_t *a, const uint16_t *b, unsigned n)
+{
+    unsigned i = 0;
+#if defined(__GNUC__) && defined(__AVX2__)
+    for(; i + 16 <= n; i += 16)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(va, vb));
+        if(neq)
+            return i + __builtin_ctz(neq) / 2;
+    }
+#elif defined(__GNUC__) && defined(__SSE2__)
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned neq = 0xFFFF & ~_mm_movemask_epi8(_mm_cmpeq_epi16(va, vb));
+        if(neq)
+            return i + __builtin_ctz(neq) / 2;
+    }
+#endif
+    for(; i < n; i++)
+        if(a[i] != b[i])
+            break;
+    return i;
+}
 
-    for(unsigned y = 0; y < max; y++)
-        for(unsigned x = 0; x < vid_sx; x++)
+// Returns the index of the last cell that differs in "a" and "b", plus one, or
+// 0 if all cells are equal.
+static unsigned last_diff(const uint16_t *a, const uint16_t *b, unsigned n)
+{
+    unsigned i = n;
+#if defined(__GNUC__) && defined(__AVX2__)
+    for(; i >= 16; i -= 16)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i - 16));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i - 16));
+        uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(va, vb));
+        if(neq)
+            return i - __builtin_clz(neq) / 2;
+    }
+#elif defined(__GNUC__) && defined(__SSE2__)
+    for(; i >= 8; i -= 8)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i - 8));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i - 8));
+        unsigned neq = 0xFFFF & ~_mm_movemask_epi8(_mm_cmpeq_epi16(va, vb));
+        if(neq)
+            return i - (__builtin_clz(neq) - 16) / 2;
+    }
+#endif
+    for(; i > 0; i--)
+        if(a[i - 1] != b[i - 1])
+            break;
+    return i;
+}
+
+// Span of cells to redraw in a row
+struct span
+{
+    unsigned x0, x1; // First cell and last cell plus one
+};
+
+// Unchanged cells between two changes that are redrawn instead of moving the
+// cursor, as the escape sequence to move is about as long.
+#define SPAN_GAP 4
+
+// Stores the spans of cells in "vm" that differ from "ts", returns the number
+// of spans.
+static unsigned find_spans(const uint16_t *vm, const uint16_t *ts, unsigned n,
+                           struct span *spans)
+{
+    unsigned x = first_diff(vm, ts, n);
+    if(x == n)
+        return 0;
+    unsigned end = last_diff(vm, ts, n);
+    unsigned num = 0;
+    spans[0].x0 = x;
+    while(++x < end)
+    {
+        unsigned next = x + first_diff(vm + x, ts + x, end - x);
+        if(next - x > SPAN_GAP)
+        {
+            spans[num++].x1 = x;
+            spans[num].x0 = next;
+        }
+        x = next;
+    }
+    spans[num++].x1 = end;
+    return num;
+}
+
+// Draws the cells of the row that differ from the terminal
+static void draw_row(const uint16_t *row, unsigned y)
+{
+    struct span spans[128];
+    unsigned num = find_spans(row, &term_screen[y][0].value, snap.sx, spans);
+    for(unsigned i = 0; i < num; i++)
+    {
+        unsigned x = spans[i].x0, x1 = spans[i].x1;
+        // Output the cells inside the terminal in runs of the same color
+        while(x < x1 && x < term_sx)
         {
-            int16_t vc = vm[x + y * vid_sx];
-            if(vc != term_screen[y][x].value)
+            union term_cell cell, next;
+            cell.value = row[x];
+            unsigned end = x + 1;
+            for(; end < x1 && end < term_sx; end++)
             {
-                // Output character
-                union term_cell cell;
-                cell.value = vc;
-                term_screen[y][x] = cell;
-                put_vc_xy(cell.chr, cell.color, x, y);
+                next.value = row[end];
+                if(next.color != cell.color)
+                    break;
             }
+            memcpy(&term_screen[y][x], row + x, (end - x) * 2);
+            term_goto_xy(x, y);
+            set_color(cell.color);
+            put_vc_cells(row + x, end - x);
+            term_posx = end;
+            if(output_row < (int)term_posy)
+                output_row = term_posy;
+            x = end;
         }
-    if(term_cursor != vid_cursor)
+        for(; x < x1; x++)
+        {
+            // Output character
+            union term_cell cell;
+            cell.value = row[x];
+            term_screen[y][x] = cell;
+            put_vc_xy(cell.chr, cell.color, x, y);
+        }
+    }
+}
+
+// Scrolls the terminal up to "n" lines, moving the origin down. The cursor
+// is moved to the row below the scrolled lines, so this is limited to the
+// terminal height minus one.
+static void term_scroll(unsigned n)
+{
+    unsigned m = n > output_row + 1 ? output_row + 1 : n;
+    if(m > term_sy - 1)
+        m = term_sy - 1;
+    if(!m)
+        return;
+    if(term_posy < m)
+        term_goto_xy(0, m);
+    output_row -= m;
+    term_posy -= m;
+    memmove(term_screen[0], term_screen[m], (term_sy - m) * sizeof(term_screen[0]));
+    for(unsigned y = term_sy - m; y < term_sy; y++)
+        for(unsigned x = 0; x < term_sx; x++)
+            term_screen[y][x] = get_cell(0x20, 0x07);
+    memset(snap.rows, 1, sizeof(snap.rows));
+}
+
+// Sends the lines scrolled out of the screen to the terminal. The lines are
+// drawn in groups at the top rows, and the terminal is scrolled once for each
+// group, leaving them in the terminal history.
+static void draw_scrolled_lines(void)
+{
+    unsigned rows = snap.sy < term_sy - 1 ? snap.sy : term_sy - 1;
+    unsigned pos = 0;
+    while(scroll_count)
     {
-        term_cursor = vid_cursor;
-        if(vid_cursor)
-            fputs("\x1b[?25h", tty_file);
+        unsigned n = scroll_count < rows ? scroll_count : rows;
+        for(unsigned y = 0; y < n; y++)
+            draw_row(scroll_lines[pos + y], y);
+        pos += n;
+        scroll_count -= n;
+        term_scroll(n);
+    }
+}
+
+// Sends the pending window scroll to the terminal, deleting lines at one end
+// of the window and inserting blank lines at the other end. As the terminal
+// origin is not known, there are no absolute rows to set a scroll region, so
+// the lines below the window are moved up and back down again.
+static void draw_window_scroll(void)
+{
+    unsigned y0 = win_scroll.y0, y1 = win_scroll.y1;
+    int n = win_scroll.n;
+    win_scroll.n = 0;
+    // Don't scroll if all the lines are replaced or not displayed yet
+    unsigned m = n < 0 ? -n : n;
+    if(!m || m > y1 - y0 || (int)y1 > output_row)
+        return;
+    uint8_t color = win_scroll.color;
+    set_color(color);
+    if(n > 0)
+    {
+        term_goto_xy(0, y0);
+        term_csi(m, 'M');
+        term_goto_xy(0, y1 + 1 - m);
+        term_csi(m, 'L');
+        memmove(term_screen[y0], term_screen[y0 + m],
+                (y1 + 1 - y0 - m) * sizeof(term_screen[0]));
+        y0 = y1 + 1 - m;
+    }
+    else
+    {
+        term_goto_xy(0, y1 + 1 - m);
+        term_csi(m, 'M');
+        term_goto_xy(0, y0);
+        term_csi(m, 'L');
+        memmove(term_screen[y0 + m], term_screen[y0],
+                (y1 + 1 - y0 - m) * sizeof(term_screen[0]));
+    }
+    for(unsigned y = y0; y < y0 + m; y++)
+        for(unsigned x = 0; x < 256; x++)
+            term_screen[y][x] = get_cell(0x20, color);
+    memset(snap.rows + win_scroll.y0, 1, win_scroll.y1 + 1 - win_scroll.y0);
+}
+
+// Scrolls a window of the displayed page in the terminal, if it is wide
+// enough that moving the full lines is better than redrawing it. Consecutive
+// scrolls of the same window are sent as one.
+static void term_window_scroll(unsigned x0, unsigned y0, unsigned x1, unsigned y1, int n)
+{
+    lock_term();
+    if(win_scroll.n && (win_scroll.y0 != y0 || win_scroll.y1 != y1))
+        draw_window_scroll();
+    // The terminal is behind the lines scrolled out of the screen
+    if(!scroll_count && x1 + 1 - x0 >= vid_sx / 2)
+    {
+        win_scroll.y0 = y0;
+        win_scroll.y1 = y1;
+        win_scroll.n += n;
+        // Inserted lines use the current background color, use a black one as
+        // not all terminals support colored blank lines.
+        win_scroll.color = vid_color & 0x0F;
+    }
+    unlock_term();
+}
+
+// Draws the snapshot of the screen to the terminal buffer.
+static void draw_screen(void)
+{
+    unsigned sx = snap.sx, sy = snap.sy;
+
+    // Start of synchronized update, removed if nothing is drawn
+    unsigned frame_start = term_buf_len;
+    if(term_sync)
+        term_puts("\x1b[?2026h");
+    unsigned frame_draw = term_buf_len;
+
+    draw_window_scroll();
+    draw_scrolled_lines();
+
+    unsigned max = output_row + 1;
+    for(unsigned y = output_row + 1; y < sy; y++)
+        if(snap.rows[y] && last_diff(snap.cells + y * sx, &term_screen[y][0].value, sx))
+            max = y + 1;
+
+    for(unsigned y = 0; y < max; y++)
+        if(snap.rows[y])
+            draw_row(snap.cells + y * sx, y);
+    // Now the terminal shows all the snapshot
+    memset(snap.rows, 0, sizeof(snap.rows));
+    if(term_cursor != snap.cursor)
+    {
+        term_cursor = snap.cursor;
+        if(term_cursor)
+            term_puts("\x1b[?25h");
         else
-            fputs("\x1b[?25l", tty_file);
+            term_puts("\x1b[?25l");
     }
-    if(term_cursor && vid_sx)
+    if(term_cursor && sx)
     {
         // Move cursor
-        term_goto_xy(crtc_cursor_loc % vid_sx, crtc_cursor_loc / vid_sx);
+        term_goto_xy(snap.cursor_loc % sx, snap.cursor_loc / sx);
+    }
+    if(term_sync)
+    {
+        if(term_buf_len == frame_draw)
+            term_buf_len = frame_start;
+        else
+            term_puts("\x1b[?2026l");
+    }
+}
+
+// Draws the snapshots as they are published, writing to the terminal with the
+// lock released so the emulator can continue.
+static void *render_thread(void *arg)
+{
+    pthread_mutex_lock(&term_lock);
+    term_locked = 1;
+    while(snap.ready || !render_quit)
+    {
+        if(!snap.ready)
+        {
+            pthread_cond_wait(&render_cond, &term_lock);
+            continue;
+        }
+        snap.ready = 0;
+        draw_screen();
+        pthread_cond_broadcast(&render_done);
+        // Swap the output buffers
+        pthread_mutex_lock(&write_lock);
+        char *out = term_buf;
+        unsigned len = term_buf_len, size = term_buf_size;
+        term_buf = term_out;
+        term_buf_size = term_out_size;
+        term_buf_len = 0;
+        term_out = out;
+        term_out_size = size;
+        term_locked = 0;
+        pthread_mutex_unlock(&term_lock);
+        term_write(out, len);
+        pthread_mutex_unlock(&write_lock);
+        pthread_mutex_lock(&term_lock);
+        term_locked = 1;
     }
-    fflush(tty_file);
+    term_locked = 0;
+    pthread_mutex_unlock(&term_lock);
+    return 0;
+}
+
+// Copies the modified rows of the displayed page to the snapshot and signals
+// the render thread, or draws it now if there is no thread.
+static void publish_screen(void)
+{
+    uint16_t memp = (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
+    uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
+
+    // Compare all the screen if the page or the size changed
+    static unsigned last_memp, last_sx, last_sy;
+    if(memp != last_memp || vid_sx != last_sx || vid_sy != last_sy)
+    {
+        mark_all_dirty();
+        last_memp = memp;
+        last_sx = vid_sx;
+        last_sy = vid_sy;
+    }
+
+    for(unsigned y = 0; y < vid_sy; y++)
+        if(row_dirty(memp, y, VIDEO_DIRTY_SCREEN))
+        {
+            memcpy(snap.cells + y * vid_sx, vm + y * vid_sx, vid_sx * 2);
+            snap.rows[y] = 1;
+        }
+    if(memp < 0x8000)
+    {
+        unsigned end, i = dirty_range(memp, vid_sy * vid_sx * 2, &end);
+        for(; i <= end; i++)
+            video_dirty[i] &= ~VIDEO_DIRTY_SCREEN;
+    }
+    snap.sx = vid_sx;
+    snap.sy = vid_sy;
+    snap.cursor = vid_cursor;
+    snap.cursor_loc = crtc_cursor_loc;
+    if(render_running)
+    {
+        snap.ready = 1;
+        pthread_cond_signal(&render_cond);
+    }
+    else
+    {
+        draw_screen();
+        term_flush();
+    }
+}
+
+// Exports the video state to the shared memory
+static void export_screen(void)
+{
+    struct emu2_shm_header *h = shm_begin_update();
+    if(!h)
+        return;
+    h->video_mode = memory[0x449];
+    h->cols = vid_sx;
+    h->rows = vid_sy;
+    h->page = vid_page;
+    h->page_addr = 0xB8000 + (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
+    h->cursor_x = crtc_cursor_loc % vid_sx;
+    h->cursor_y = crtc_cursor_loc / vid_sx;
+    h->cursor_on = vid_cursor;
+    shm_end_update();
+}
+
+// Compares current screen with memory data
+void check_screen(void)
+{
+    if(video_initialized)
+        export_screen();
+
+    // Exit if not in video mode or there is no terminal
+    if(!video_initialized || headless)
+        return;
+
+    debug(debug_video, "check_screen, redrawing\n");
+    debug_screen();
+
+    lock_term();
+    publish_screen();
+    unlock_term();
+    last_frame = emu_get_ticks(1000);
+    key_pressed = 0;
+}
+
+void video_update(void)
+{
+    if(!video_initialized)
+        return;
+    if(frame_ms && emu_get_ticks(1000) - last_frame < frame_ms)
+        return;
+    check_screen();
+}
+
+void video_key_pressed(void)
+{
+    key_pressed = 1;
+}
+
+void video_idle(void)
+{
+    if(key_pressed)
+        check_screen();
 }
 
 static void vid_scroll_up(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, int n, int page)
@@ -486,36 +1329,62 @@ static void vid_scroll_up(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, int n,
     if(n > y1 - y0 + 1 || !n)
         n = y1 + 1 - y0;
 
-    // Scroll TERMINAL if we are scrolling (almost) the entire screen
-    if(y0 == 0 && y1 >= vid_sy - 2 && x0 < 2 && x1 >= vid_sx - 2)
+    uint16_t memp = (page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
+    uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
+
+    // Scroll TERMINAL if we are scrolling (almost) the entire screen: save the
+    // lines that go out of the screen, they are sent at the next update.
+    if(tty_fd >= 0 && (page & 7) == vid_page && y0 == 0 && y1 >= vid_sy - 2 &&
+       x0 < 2 && x1 >= vid_sx - 2)
     {
-        // Update screen before
-        check_screen();
-        unsigned m = n > output_row + 1 ? output_row + 1 : n;
-        if(term_posy < m)
-            term_goto_xy(0, m);
-        output_row -= m;
-        term_posy -= m;
-        for(unsigned y = 0; y + m < term_sy; y++)
-            for(unsigned x = 0; x < term_sx; x++)
-                term_screen[y][x].value = term_screen[y + m][x].value;
-        for(unsigned y = term_sy - m; y < term_sy; y++)
-            for(unsigned x = 0; x < term_sx; x++)
-                term_screen[y][x] = get_cell(0x20, 0x07);
+        lock_term();
+        // If there is no more space, wait for the render thread to send the
+        // lines, so that no output is lost.
+        if(scroll_count + n > scroll_size)
+        {
+            unsigned size = scroll_size ? scroll_size * 2 : 1024;
+            void *lines = 0;
+            if(size <= MAX_SCROLL_LINES)
+                lines = realloc(scroll_lines, size * sizeof(scroll_lines[0]));
+            if(lines)
+            {
+                scroll_lines = lines;
+                scroll_size = size;
+            }
+            else if(!scroll_size)
+            {
+                // Exits after unlocking
+                term_no_memory = 1;
+                unlock_term();
+            }
+            else
+            {
+                publish_screen();
+                while(scroll_count + n > scroll_size)
+                    pthread_cond_wait(&render_done, &term_lock);
+            }
+        }
+        // Send the previous window scroll before those lines
+        if(win_scroll.n)
+            draw_window_scroll();
+        for(int y = 0; y < n; y++)
+            memcpy(scroll_lines[scroll_count++], vm + y * vid_sx, vid_sx * 2);
+        unlock_term();
     }
-    else
-        debug_screen();
+    else if(tty_fd >= 0 && (page & 7) == vid_page)
+        term_window_scroll(x0, y0, x1, y1, n);
 
     // Scroll VIDEO
-    uint16_t memp = (page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
-    uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
-    for(unsigned y = y0; y + n <= y1; y++)
-        for(unsigned x = x0; x <= x1; x++)
-            vm[x + y * vid_sx] = vm[x + y * vid_sx + n * vid_sx];
+    if(x0 == 0 && x1 == vid_sx - 1)
+        memmove(vm + y0 * vid_sx, vm + (y0 + n) * vid_sx, (y1 + 1 - y0 - n) * vid_sx * 2);
+    else
+        for(unsigned y = y0; y + n <= y1; y++)
+            memmove(vm + x0 + y * vid_sx, vm + x0 + (y + n) * vid_sx, (x1 + 1 - x0) * 2);
     // Set last rows
     for(unsigned y = y1 - (n - 1); y <= y1; y++)
         for(unsigned x = x0; x <= x1; x++)
             vm[x + y * vid_sx] = get_cell(0x20, vid_color).value;
+    mark_dirty_range(0xB8000 + memp + y0 * vid_sx * 2, (y1 + 1 - y0) * vid_sx * 2);
 
     debug(debug_video, "after scroll\n");
     debug_screen();
@@ -525,7 +1394,6 @@ static void vid_scroll_dwn(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, unsig
                            int page)
 {
     debug(debug_video, "scroll down %u: (%u, %u) - (%u, %u)\n", n, x0, y0, x1, y1);
-    debug_screen();
 
     // Check parameters
     if(x1 >= vid_sx)
@@ -537,27 +1405,34 @@ static void vid_scroll_dwn(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, unsig
     if(n > y1 - y0 + 1U || !n)
         n = y1 + 1 - y0;
 
-    // TODO: try to scroll TERMINAL
+    // Scroll TERMINAL
+    if(tty_fd >= 0 && (page & 7) == vid_page)
+        term_window_scroll(x0, y0, x1, y1, -(int)n);
 
     // Scroll VIDEO
     uint16_t memp = (page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
     uint16_t *vm = (uint16_t *)(memory + 0xB8000 + memp);
-    for(unsigned y = y1; y >= y0 + n; y--)
-        for(unsigned x = x0; x <= x1; x++)
-            vm[x + y * vid_sx] = vm[x + y * vid_sx - n * vid_sx];
+    if(x0 == 0 && x1 == vid_sx - 1)
+        memmove(vm + (y0 + n) * vid_sx, vm + y0 * vid_sx, (y1 + 1 - y0 - n) * vid_sx * 2);
+    else
+        for(unsigned y = y1; y >= y0 + n; y--)
+            memmove(vm + x0 + y * vid_sx, vm + x0 + (y - n) * vid_sx, (x1 + 1 - x0) * 2);
     // Set first rows
     for(unsigned y = y0; y < y0 + n; y++)
         for(unsigned x = x0; x <= x1; x++)
             vm[x + y * vid_sx] = get_cell(0x20, vid_color).value;
+    mark_dirty_range(0xB8000 + memp + y0 * vid_sx * 2, (y1 + 1 - y0) * vid_sx * 2);
 
     debug(debug_video, "after scroll\n");
     debug_screen();
 }
 
+// Returns the address of a cell to write, marking it as modified
 static uint16_t *addr_xy(unsigned x, unsigned y, int page)
 {
     uint16_t mem = (page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
     uint16_t *vm = (uint16_t *)(memory + 0xB8000 + mem);
+    mark_dirty(0xB8000 + mem + (x + y * vid_sx) * 2);
     return &vm[x + y * vid_sx];
 }
 
@@ -606,8 +1481,12 @@ static void video_putchar(uint8_t ch, uint16_t at, int page)
     else if(ch == 0x07)
     {
         // BEL, just write to the terminal now
-        if(tty_file)
-            putc('\x07', tty_file);
+        if(tty_fd >= 0)
+        {
+            lock_term();
+            term_putc('\x07');
+            unlock_term();
+        }
     }
     else
     {
@@ -956,3 +1835,65 @@ int video_get_col(void)
 {
     return vid_posx[vid_page];
 }
+
+int video_text_init(struct screen_text *t)
+{
+    // The match position is only needed to check the column
+    int flags = t->col < 0 ? REG_EXTENDED | REG_NOSUB : REG_EXTENDED;
+    return !t->regex || !regcomp(&t->re, t->text, flags);
+}
+
+// Returns 1 if the text is in the row, that has the given length.
+static int row_has_text(struct screen_text *t, const char *row, unsigned len)
+{
+    if(t->col >= (int)len)
+        return 0;
+    if(t->col >= 0)
+        row += t->col;
+    if(!t->regex && t->col >= 0)
+        return !strncmp(row, t->text, strlen(t->text));
+    else if(!t->regex)
+        return strstr(row, t->text) != 0;
+    regmatch_t m;
+    if(regexec(&t->re, row, 1, &m, 0))
+        return 0;
+    return t->col < 0 || m.rm_so == 0;
+}
+
+int video_find_text(struct screen_text *t, int restart)
+{
+    uint16_t memp = (vid_page & 7) * (vid_sy > 25 ? 0x2000 : 0x1000);
+    const union term_cell *vm = (const union term_cell *)(memory + 0xB8000 + memp);
+    unsigned sx = vid_sx < 256 ? vid_sx : 256, sy = vid_sy < 64 ? vid_sy : 64;
+
+    // Search all the rows if the page or the size changed
+    static unsigned last_memp, last_sx, last_sy;
+    if(memp != last_memp || vid_sx != last_sx || vid_sy != last_sy)
+    {
+        restart = 1;
+        last_memp = memp;
+        last_sx = vid_sx;
+        last_sy = vid_sy;
+    }
+
+    int found = 0;
+    for(unsigned y = 0; y < sy && !found; y++)
+    {
+        if(t->row >= 0 && t->row != (int)y)
+            continue;
+        if(!restart && !row_dirty(memp, y, VIDEO_DIRTY_TEXT))
+            continue;
+        char row[257];
+        for(unsigned x = 0; x < sx; x++)
+            row[x] = vm[x + y * vid_sx].chr ? vm[x + y * vid_sx].chr : ' ';
+        row[sx] = 0;
+        found = row_has_text(t, row, sx);
+    }
+    if(memp < 0x8000)
+    {
+        unsigned end, i = dirty_range(memp, vid_sy * vid_sx * 2, &end);
+        for(; i <= end; i++)
+            video_dirty[i] &= ~VIDEO_DIRTY_TEXT;
+    }
+    return found;
+}
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <regex.h>
 #include <stdint.h>
 
 void intr10(void);
 // Redraws terminal screen
 void check_screen(void);
+// Redraws terminal screen at the periodic update, skipped if the terminal is
+// not ready or the last update was too recent.
+void video_update(void);
+// Signals a key press, the screen is redrawn as soon as the program waits
+// for the next one.
+void video_key_pressed(void);
+// Called when the program waits for input.
+void video_idle(void);
 // Returns 1 if video emulation is active.
 int video_active(void);
 // Writes a character to the video screen
@@ -16,3 +25,32 @@ uint8_t video_crtc_read(int port);
 void video_crtc_write(int port, uint8_t value);
 // Initializes emulated video memory and tables
 void video_init_mem(void);
+
+// Text to find in the screen, in DOS characters
+struct screen_text
+{
+    char *text; // Text, or extended regular expression if "regex" is set
+    int regex;
+    int row, col; // Position of the text, or -1 to find it in any position
+    regex_t re;
+};
+// Prepares the text for searching, returns 0 if the regular expression is not
+// valid.
+int video_text_init(struct screen_text *t);
+// Returns 1 if the text is in the displayed page. Only the rows changed after
+// the last call are searched, unless "restart" is set.
+int video_find_text(struct screen_text *t, int restart);
+
+// Counters of the terminal output, and writes done holding the lock of the
+// terminal state, that make the emulator wait for the terminal.
+struct video_stats
+{
+    uint64_t bytes, escapes, writes;
+    uint64_t locked_writes;
+};
+// Starts video emulation for benchmarks: the output is written to "fd" in
+// the calling thread and counted in "stats".
+void video_bench_init(int fd, struct video_stats *stats);
+// Draws in the render thread for the next benchmarks, writing to "fd", as
+// with a terminal. With -1, waits for the thread to write all and stops it.
+void video_bench_render(int fd);